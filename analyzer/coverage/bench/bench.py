@@ -0,0 +1,260 @@
+#!/usr/bin/env python
+
+'''
+    bench.py measures what every tracing mode of the coverage pintool
+    costs. Every workload runs natively first and then under each mode,
+    and the following are reported per mode:
+
+    - the mean wall clock time of a run, natively and under Pin
+    - the slowdown against the native run and the executions per second
+    - the bytes of trace written over the channel (FIFO, pipe or shm)
+    - the peak RSS of the instrumented process, where wait4() exists
+
+    The synthetic workloads are the ones of workload.c, which the bench
+    target of makefile.rules builds. The PNG workload runs a decoder on
+    the seeds of a directory, e.g. pngcheck on the initial population,
+    and only if --png-dir is given.
+
+    The numbers include the start up of Pin, so the workloads should
+    run long enough for the mode of interest to dominate. The peak RSS
+    also counts the few MB of the harness that is forked before the exec
+    of the target.
+'''
+
+import os
+import sys
+import time
+import glob
+import json
+import shlex
+import argparse
+import platform
+import threading
+import subprocess
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+        '..', '..', '..'))
+from analyzer import pin
+
+# (name, pintool options, size of the shared memory region or 0)
+MODES = (
+    ('raw', [], 0),
+    ('tracebatch', ['-tracebatch'], 0),
+    ('dedup', ['-dedup'], 0),
+    ('firsthit', ['-firsthit'], 0),
+    ('hitcounts', ['-hitcounts'], 0),
+    ('edges', ['-dedup', '-edges'], 0),
+    ('stackhash', ['-dedup', '-stackhash'], 0),
+    ('cmplog', ['-dedup', '-cmplog'], 0),
+    ('async', ['-async', '4'], 0),
+    ('shm', ['-dedup'], 64 * 1024 * 1024),
+    )
+
+# (name, arguments of workload.c)
+WORKLOADS = (
+    ('loop', 'loop 50000000'),
+    ('calls', 'calls 64 200000'),
+    ('blocks', 'blocks 20000'),
+    ('threads', 'threads 8 10000000'),
+    ('cmps', 'cmps 5000000'),
+    )
+
+class Result(object):
+    '''
+        The measurements of a workload under a mode, over all of its
+        runs.
+    '''
+    runs = None
+    seconds = None
+    transferred = None
+    rss = None
+
+    def __init__(self):
+        self.runs = 0
+        self.seconds = 0.0
+        self.transferred = 0
+        self.rss = None
+
+    def add(self, seconds, transferred, rss):
+        self.runs += 1
+        self.seconds += seconds
+        self.transferred += transferred
+        if rss != None:
+            self.rss = max(self.rss, rss)
+
+    def mean(self):
+        return self.seconds / self.runs if self.runs else 0.0
+
+    def execs(self):
+        return self.runs / self.seconds if self.seconds else 0.0
+
+def wait(process, timer=None):
+    '''
+        Waits for the process and returns its peak RSS in KB, or None
+        if the platform does not report it.
+    '''
+    rss = None
+    if hasattr(os, 'wait4'):
+        _, status, usage = os.wait4(process.pid, 0)
+        # the Popen object must not wait for it again
+        process.returncode = status
+        rss = usage.ru_maxrss
+    else:
+        process.wait()
+    if timer != None:
+        timer.cancel()
+    return rss
+
+def drain(path, transferred):
+    '''
+        Reads the FIFO or the named pipe of a run until the pintool
+        closes it, counting the bytes.
+    '''
+    total = 0
+    with open(path, 'rb') as fin:
+        while True:
+            buf = fin.read(1 << 20)
+            if not buf:
+                break
+            total += len(buf)
+    transferred.append(total)
+
+def run_native(command):
+    start = time.time()
+    with open(os.devnull, 'w') as nullfp:
+        process = subprocess.Popen(shlex.split(command), stdout=nullfp,
+                stderr=nullfp)
+        rss = wait(process)
+    return time.time() - start, 0, rss
+
+def run_pin(runner, command, image, fifo):
+    '''
+        Runs the command once under the pintool and returns the wall
+        clock time, the bytes of the trace and the peak RSS.
+    '''
+    start = time.time()
+    output = runner.run(command, output=fifo, whitelist=[image])
+    if runner.shared != None:
+        rss = wait(runner.process, runner.timer)
+        transferred = len(output.open().getvalue())
+        return time.time() - start, transferred, rss
+
+    transferred = []
+    reader = threading.Thread(target=drain, args=(output, transferred))
+    reader.start()
+    rss = wait(runner.process, runner.timer)
+    reader.join(1.0)
+    if reader.is_alive() and platform.system() == 'Linux':
+        # the pintool never opened the FIFO, unblock the reader
+        os.close(os.open(output, os.O_WRONLY | os.O_NONBLOCK))
+    reader.join()
+    elapsed = time.time() - start
+
+    if platform.system() == 'Linux':
+        os.unlink(output)
+    return elapsed, transferred[0] if transferred else 0, rss
+
+def bench(name, commands, image, modes, args):
+    '''
+        Runs every command of the workload natively and under every
+        mode, args.runs times each, and returns the results by mode.
+    '''
+    results = {'native': Result()}
+    for _ in xrange(args.runs):
+        for command in commands:
+            results['native'].add(*run_native(command))
+
+    fifo = os.path.abspath('bench-%d.fifo' % os.getpid())
+    for mode, options, shared in modes:
+        runner = pin.Coverage(pintool=args.tool, timeout=args.timeout,
+                options=options, shared_memory=shared)
+        if args.pin:
+            runner.cmd_template = '%s -t %%s %%s' % args.pin
+        result = results[mode] = Result()
+        for _ in xrange(args.runs):
+            for command in commands:
+                result.add(*run_pin(runner, command, image, fifo))
+        if runner.shared != None:
+            runner.shared.close()
+        print_result(name, mode, result, results['native'])
+    return results
+
+def print_header():
+    print '%-10s %-12s %10s %10s %9s %10s %14s %10s' % (
+            'workload', 'mode', 'native(s)', 'pin(s)', 'slowdown',
+            'execs/s', 'bytes/run', 'rss(KB)')
+
+def print_result(name, mode, result, native):
+    slowdown = result.mean() / native.mean() if native.mean() else 0.0
+    print '%-10s %-12s %10.3f %10.3f %8.1fx %10.2f %14d %10s' % (
+            name, mode, native.mean(), result.mean(), slowdown,
+            result.execs(), result.transferred / max(result.runs, 1),
+            result.rss if result.rss != None else '-')
+    sys.stdout.flush()
+
+def main(args):
+    modes = MODES
+    if args.modes:
+        wanted = args.modes.split(',')
+        modes = [mode for mode in MODES if mode[0] in wanted]
+
+    workload = os.path.abspath(args.workload)
+    suites = []
+    for name, arguments in WORKLOADS:
+        if args.workloads and name not in args.workloads.split(','):
+            continue
+        suites.append((name, ['%s %s' % (workload, arguments)], workload))
+
+    if args.png_dir:
+        seeds = sorted(glob.glob(os.path.join(args.png_dir, '*')))
+        seeds = seeds[:args.png_seeds]
+        decoder = shlex.split(args.png_cmd)[0]
+        suites.append(('png', [args.png_cmd % seed for seed in seeds],
+                decoder))
+
+    print_header()
+    report = {}
+    for name, commands, image in suites:
+        results = bench(name, commands, image, modes, args)
+        report[name] = dict(
+                (mode, {
+                    'runs': result.runs,
+                    'mean': result.mean(),
+                    'execs': result.execs(),
+                    'bytes': result.transferred,
+                    'rss': result.rss,
+                    })
+                for mode, result in results.iteritems())
+
+    if args.json:
+        with open(args.json, 'w') as fout:
+            json.dump(report, fout, indent=2, sort_keys=True)
+    return 0
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+            description='Overhead benchmark of the coverage pintool'
+            )
+    parser.add_argument('--tool', required=True,
+            help='/path/to/coverage.so')
+    parser.add_argument('--workload', required=True,
+            help='/path/to/the/workload/of/workload.c')
+    parser.add_argument('--pin', default=None,
+            help='the pin launcher, if it is not in the PATH')
+    parser.add_argument('--runs', type=int, default=3,
+            help='runs of every workload per mode')
+    parser.add_argument('--modes', default=None,
+            help='comma separated modes to run, all by default')
+    parser.add_argument('--workloads', default=None,
+            help='comma separated synthetic workloads to run, all by default')
+    parser.add_argument('--png-dir', default=None,
+            help='directory of PNG seeds for the decoder workload')
+    parser.add_argument('--png-cmd', default='/usr/bin/pngcheck %s',
+            help='command line of the PNG decoder, %%s is the seed')
+    parser.add_argument('--png-seeds', type=int, default=20,
+            help='the most seeds of --png-dir to decode')
+    parser.add_argument('--timeout', type=int, default=300,
+            help='seconds after which a run is stopped')
+    parser.add_argument('--json', default=None,
+            help='also write the results to this file')
+    sys.exit(main(parser.parse_args()))
@@ -0,0 +1,178 @@
+/*
+ * Synthetic workloads of the overhead benchmark, see bench.py. Every
+ * workload stresses a different part of the instrumentation:
+ *
+ *   loop N            a tight loop, the same few blocks N times
+ *   calls DEPTH N     N call chains DEPTH calls deep, for -stackhash
+ *   blocks N          N passes over 256 small blocks of a switch
+ *   threads T N       the loop workload in T threads at once
+ *   cmps N            N comparisons against constants, for -cmplog
+ *
+ * The result of every workload is printed, so that the compiler does
+ * not optimize it away.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+typedef unsigned long long u64;
+
+static u64
+loop(u64 n)
+{
+    u64 acc = 0;
+    for (u64 i = 0; i < n; i++)
+        acc = acc * 31 + (i ^ (acc >> 7));
+    return acc;
+}
+
+static u64
+chain(unsigned depth, u64 value)
+{
+    if (depth == 0)
+        return value * 2654435761U;
+    return chain(depth - 1, value + depth) ^ depth;
+}
+
+static u64
+calls(unsigned depth, u64 n)
+{
+    u64 acc = 0;
+    for (u64 i = 0; i < n; i++)
+        acc += chain(depth, i);
+    return acc;
+}
+
+#define CASE4(n) \
+    case n: acc += n; break; \
+    case n + 1: acc ^= n + 1; break; \
+    case n + 2: acc -= n + 2; break; \
+    case n + 3: acc *= n + 3; break;
+#define CASE16(n) CASE4(n) CASE4(n + 4) CASE4(n + 8) CASE4(n + 12)
+#define CASE64(n) CASE16(n) CASE16(n + 16) CASE16(n + 32) CASE16(n + 48)
+
+static u64
+blocks(u64 n)
+{
+    u64 acc = 1;
+    for (u64 i = 0; i < n; i++)
+    {
+        for (unsigned j = 0; j < 256; j++)
+        {
+            switch ((j * 167 + (unsigned)i) & 0xff)
+            {
+                CASE64(0)
+                CASE64(64)
+                CASE64(128)
+                CASE64(192)
+            }
+        }
+    }
+    return acc;
+}
+
+static u64
+cmps(u64 n)
+{
+    u64 acc = 0;
+    for (u64 i = 0; i < n; i++)
+    {
+        unsigned value = (unsigned)(i * 2654435761U);
+        if (value == 0x474e5089)
+            acc++;
+        if ((value & 0xffff) == 0x4452)
+            acc += 2;
+        if (!memcmp(&value, "IHDR", 4))
+            acc += 3;
+    }
+    return acc;
+}
+
+static u64 thread_n;
+
+#ifdef _WIN32
+static DWORD WINAPI
+thread_main(LPVOID arg)
+{
+    *(u64 *)arg = loop(thread_n);
+    return 0;
+}
+#else
+static void *
+thread_main(void *arg)
+{
+    *(u64 *)arg = loop(thread_n);
+    return NULL;
+}
+#endif
+
+static u64
+threads(unsigned count, u64 n)
+{
+    u64 results[64], acc = 0;
+    if (count > 64)
+        count = 64;
+    thread_n = n;
+
+#ifdef _WIN32
+    HANDLE handles[64];
+    for (unsigned i = 0; i < count; i++)
+        handles[i] = CreateThread(NULL, 0, thread_main, results + i, 0, NULL);
+    WaitForMultipleObjects(count, handles, TRUE, INFINITE);
+    for (unsigned i = 0; i < count; i++)
+        CloseHandle(handles[i]);
+#else
+    pthread_t tids[64];
+    for (unsigned i = 0; i < count; i++)
+        pthread_create(tids + i, NULL, thread_main, results + i);
+    for (unsigned i = 0; i < count; i++)
+        pthread_join(tids[i], NULL);
+#endif
+
+    for (unsigned i = 0; i < count; i++)
+        acc += results[i];
+    return acc;
+}
+
+static int
+usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s loop N | calls DEPTH N | blocks N | threads T N | cmps N\n",
+            name);
+    return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 3)
+        return usage(argv[0]);
+
+    const char *name = argv[1];
+    u64 a = strtoull(argv[2], NULL, 0);
+    u64 b = argc > 3 ? strtoull(argv[3], NULL, 0) : 0;
+    u64 result;
+
+    if (!strcmp(name, "loop"))
+        result = loop(a);
+    else if (!strcmp(name, "calls") && argc > 3)
+        result = calls((unsigned)a, b);
+    else if (!strcmp(name, "blocks"))
+        result = blocks(a);
+    else if (!strcmp(name, "threads") && argc > 3)
+        result = threads((unsigned)a, b);
+    else if (!strcmp(name, "cmps"))
+        result = cmps(a);
+    else
+        return usage(argv[0]);
+
+    printf("%s: %llx\n", name, result);
+    return 0;
+}
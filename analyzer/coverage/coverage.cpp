@@ -8,7 +8,12 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 
 #elif TARGET_WINDOWS
 namespace WIN32_API {
@@ -18,6 +23,54 @@ namespace WIN32_API {
 
 /* Definitions of pintool's data structures. */
 
+// the IDA basic blocks of an image, as offsets
+// sorted by their start.
+typedef struct
+{
+    UINT32 start;
+    UINT32 end;
+} ida_block_t;
+
+typedef struct
+{
+    ida_block_t *list;
+    UINT32 len;
+} ida_blocks_t;
+
+// what a Pin basic block of an image resolved to, see tcache_load()
+typedef struct
+{
+    UINT32 bbl;
+    UINT32 block;
+} tcache_entry_t;
+
+typedef struct tcache
+{
+    tcache_entry_t *slots; // open addressing, by the offset of the block
+    UINT32 mask;
+    UINT32 len;
+    UINT32 saved; // the entries that are in the file already
+    UINT64 key;
+} tcache_t;
+
+// an instrumented trace in first-hit mode, see bbl_first_hit_handler()
+typedef struct
+{
+    ADDRINT low;
+    ADDRINT high;
+    UINT32 offset; // of the trace in its image
+    UINT32 removed;
+} span_t;
+
+// the spans of an image. A trace that is compiled again gets its span
+// back, so re-instrumentation and code cache flushes allocate nothing.
+typedef struct
+{
+    span_t **slots; // open addressing, by the offset of the trace
+    UINT32 mask;
+    UINT32 len;
+} spans_t;
+
 // struct that holds information
 // about an image.
 typedef struct
@@ -27,13 +80,31 @@ typedef struct
     INT32 loaded;
     char *path;
     UINT32 index;
+    UINT8 *map; // one counter per byte offset, used in dedup mode
+    ida_blocks_t *blocks; // loaded from the .idmp of the image, if any
+    ida_blocks_t *filter; // the spans to instrument, all of them if NULL
+    tcache_t *tcache; // how its blocks resolved in the previous runs
+    const char *idmp; // its .idmp, until the trace cache misses
+    spans_t *spans; // its traces instrumented in first-hit mode
 } image_t;
 
+// address range of a loaded image, kept sorted by the low address
+typedef struct
+{
+    ADDRINT low;
+    ADDRINT high;
+    image_t *image;
+} range_t;
+
 // whitelist type
 typedef struct
 {
     image_t *list;
     off_t len;
+    INT32 *names; // open addressing on the basenames, -1 if empty
+    UINT32 names_mask;
+    range_t *ranges;
+    UINT32 nranges;
 } whitelist_t;
 
 typedef struct {
@@ -41,35 +112,455 @@ typedef struct {
     UINT64 bbl;
 } node_t;
 
-typedef struct 
+// Output of the trace format v2. The stream is a header followed
+// by sections [type, 1 byte][payload length, 4 bytes][payload], in
+// which all values are LEB128 varints unless noted otherwise. The
+// encoder builds one or more complete sections in buf, which are
+// then written at once.
+typedef struct
+{
+    UINT8 *buf;
+    UINT32 size;
+    UINT32 len;
+    UINT32 mark; // start of the open section
+} encoder_t;
+
+// Shadow call stack, only kept with -stackhash. It is a ring of the
+// call sites (image << 32 | offset), so that the frames on top are
+// still right when the application recurses deeper than the ring.
+#define SHADOW_DEPTH 64 // power of 2
+#define STACK_HASH_FRAMES 8
+typedef struct
+{
+    UINT64 frames[SHADOW_DEPTH];
+    UINT32 depth;
+} shadow_t;
+
+// The faulting context of a crash, written as a SEC_CRASH section
+// along with the records of the crashing thread.
+typedef struct
+{
+    UINT32 signal; // signal or exception, 0 if there is no crash
+    UINT32 image; // whitelist index + 1, 0 for other images
+    UINT64 offset; // of the faulting pc inside its image
+    UINT64 fault; // the faulting address, 0 if unknown
+    UINT32 hash; // of the top frames of the shadow stack
+    UINT32 depth;
+    char name[64]; // basename of an image that is not whitelisted
+} crash_t;
+
+typedef struct bucket_s
 {
     UINT64 size;
     node_t *start;
     node_t *curr; // points to the first *empty* node
     node_t *end; // points right *after* the allocated region
     UINT32 guard;
+    UINT64 tag; // thread id, already shifted into the image number
+    encoder_t enc;
+    struct bucket_s *next; // list of the per-thread buckets
+    shadow_t shadow;
+    crash_t crash;
+    ADDRINT fault; // faulting address of the last fault_signal
+    INT32 fault_signal;
 } bucket_t;
 
+// Statistics of a run, written in a SEC_STATS trailer after the rest
+// of the trace. The counters are updated under the locks that their
+// code paths hold anyway: the instrumentation ones under the VM lock
+// of Pin and the output ones under write_lock, or async_lock for the
+// time the threads wait for a spare buffer with -async. Pin does not
+// expose the time it spends compiling, jit_us is the time of its
+// callbacks.
+typedef struct
+{
+    UINT64 traces; // compiled by Pin
+    UINT64 instrumented; // of the traces, in the whitelisted images
+    UINT64 jit_us; // spent in the instrumentation callbacks
+    UINT64 writes; // to the output
+    UINT64 bytes; // written to the output
+    UINT64 blocked_us; // the application threads waited for the driver
+    UINT64 threads; // application threads started
+} stats_t;
+
 /* Declaration of global variables */
 uint64_t bbls_count;
+stats_t stats;
 #ifdef TARGET_LINUX
 int pipeHandle;
 #elif TARGET_WINDOWS
 WIN32_API::HANDLE pipeHandle;
 WIN32_API::HANDLE TimeoutEvent;
-volatile WIN32_API::BOOL IsProcessRunning = true;
-volatile WIN32_API::BOOL IsProcessSignaled = false;
-PIN_LOCK *PinThreadLock;
-PIN_THREAD_UID InternalPINThreadUid;
 #else
 #error "This operating system is not supported yet."
 #endif
+// the internal thread that watches for timeouts
+volatile BOOL IsProcessRunning = true;
+PIN_THREAD_UID InternalPINThreadUid;
 
-#define IS_BUCKET_FULL(bkt) (bkt->curr > bkt->end)
+#define IS_BUCKET_FULL(bkt) (bkt->curr >= bkt->end)
+#define THREAD_INDEX(tid, index) (((UINT64)(tid) << 32) | (index))
+#define MARKER_INDEX 0xFFFFFFFFFFFFFFFF
+
+// Each application thread records into its own bucket, which is kept
+// in Pin TLS and flushed independently. The global bucket is used for
+// the records that belong to the whole process. output_lock serializes
+// the writes to the output and guards the list of thread buckets.
+// bucket_reg is a Pin tool register that holds the bucket of the
+// current thread, so that the analysis routines can be inlined.
 bucket_t *bucket;
+bucket_t *thread_buckets;
+TLS_KEY bucket_key;
+REG bucket_reg;
+int bucket_size;
+PIN_LOCK output_lock;
+BOOL output_closed = true; // until init_output() succeeds
 whitelist_t whitelist;
 
+// if set, each basic block is recorded in the image's map
+// and only the unique offsets are written out at exit.
+BOOL dedup_mode;
+
+// if set, the entries of the dedup map are saturating hit counters
+// and their buckets are written out along with the offsets.
+BOOL hit_count_mode;
+
+// Edge coverage. Every (previous block, current block) pair is
+// hashed into a fixed size map, like AFL does. The previous block
+// is kept per thread in a Pin tool register.
+#define EDGE_MAP_BITS 16
+#define EDGE_MAP_SIZE (1 << EDGE_MAP_BITS)
+BOOL edge_mode;
+REG prev_loc_reg;
+UINT8 edge_map[EDGE_MAP_SIZE];
+
+// if set, calls and returns of the whitelisted images are tracked
+// in a shadow stack per thread, which is hashed on a crash.
+BOOL stack_hash_mode;
+
+// CmpLog mode. The operands of the comparisons of the whitelisted
+// images, and the buffers of the memcmp() family called from them,
+// are kept in a fixed table indexed by a hash of the comparison site.
+// An entry keeps the last CMP_PAIRS distinct pairs of its site; sites
+// that collide share the entry.
+#define CMP_TABLE_BITS 12
+#define CMP_TABLE_SIZE (1 << CMP_TABLE_BITS)
+#define CMP_PAIRS 4
+#define CMP_BYTES 32 // the most that is kept of a routine's buffers
+#define CMP_SIZE_MASK 0xFF
+#define CMP_MEM0 0x100 // the first operand is a memory address
+#define CMP_MEM1 0x200
+#define CMP_INS 1
+#define CMP_RTN 2
+
+typedef struct
+{
+    UINT64 site; // image << 32 | offset of the instruction or the call
+    UINT32 kind;
+    UINT32 count; // pairs recorded so far
+    UINT8 len[CMP_PAIRS];
+    UINT8 ops[CMP_PAIRS][2][CMP_BYTES];
+} cmp_entry_t;
+
+BOOL cmp_log_mode;
+cmp_entry_t cmp_table[CMP_TABLE_SIZE];
+
+// First-hit mode. Once a block of a trace is recorded the whole trace
+// is removed from the code cache and re-instrumented without the calls
+// of the blocks that are already in the map, so hot code eventually
+// runs without any analysis call.
+BOOL first_hit_mode;
+
+// Trace batching. Every instrumented trace is registered in a table
+// with the offsets of its blocks, and a single record per execution
+// of the trace is written: its id and the number of blocks that ran.
+// A trace has a single entry, so the blocks that ran are always a
+// prefix of it; the record is written either at a taken side exit or
+// at the head of the last block. The table follows the records.
+#define TRACE_INDEX 0xFFFFFFFD
+#define TRACE_MAX_BBLS 0xFFFF
+// the offset in the table of a block that is not reported, one that is
+// filtered out or is not part of an IDA basic block
+#define TRACE_SKIP 0xFFFFFFFF
+
+typedef struct
+{
+    UINT32 image;
+    UINT32 count;
+    UINT32 *offsets;
+} trace_entry_t;
+
+typedef struct
+{
+    trace_entry_t *list;
+    UINT32 len;
+    UINT32 size;
+} trace_table_t;
+
+BOOL trace_batch_mode;
+trace_table_t trace_table;
+
 VOID write_to_pipe(VOID *, size_t);
+VOID pipe_write(VOID *, size_t);
+UINT64 clock_us();
+VOID shm_write(VOID *, size_t);
+VOID forksrv_hook(IMG);
+VOID cmp_hook(IMG);
+VOID trace_flush();
+
+/* Trace format v2 */
+#define TRACE_MAGIC 0x5a485443
+#define TRACE_VERSION 2
+// the offsets are the starts of the IDA basic blocks where known
+#define TRACE_FLAG_IDA 0x1
+
+#define SEC_HEADER_SIZE 5
+// an open section must have room for a few more varints
+#define SEC_ROOM 32
+
+#define SEC_BLOCKS 1 // [image][sorted offsets, delta encoded]
+#define SEC_RAW 2 // [thread, 4 bytes][(image, zigzag offset delta)...]
+#define SEC_EDGES 3 // [(edge index delta, bucket)...]
+#define SEC_EVENT 4 // [thread, 4 bytes][signal or exception]
+#define SEC_TRACES 5 // [thread, 4 bytes][(trace id << 16 | blocks)...]
+#define SEC_TRACE_TABLE 6 // [first id][(image, count, zigzag offset deltas)...]
+#define SEC_COUNTS 7 // [image][(sorted offset delta, hit count bucket)...]
+#define SEC_CRASH 8 // [thread, 4 bytes][signal][image + 1][pc offset][fault address]
+                    // [stack hash][stack depth][name length][name]
+#define SEC_CMPS 9 // [(site, kind, pairs, (length, operand bytes, operand bytes)...)...]
+#define SEC_STATS 10 // [the counters of stats_t, in order]
+#define CRASH_ROOM (SEC_ROOM + 7 * 10 + sizeof(((crash_t *)0)->name))
+
+#define ZIGZAG(v) (((UINT64)(v) << 1) ^ (UINT64)((INT64)(v) >> 63))
+
+INT32
+enc_init(encoder_t *enc, UINT32 size)
+{
+    enc->buf = (UINT8 *)malloc(size);
+    enc->size = size;
+    enc->len = enc->mark = 0;
+    return enc->buf == NULL ? -1 : 0;
+}
+
+VOID
+enc_varint(encoder_t *enc, UINT64 value)
+{
+    UINT8 *p = enc->buf + enc->len;
+    while (value >= 0x80)
+    {
+        *p++ = (UINT8)value | 0x80;
+        value >>= 7;
+    }
+    *p++ = (UINT8)value;
+    enc->len = (UINT32)(p - enc->buf);
+}
+
+VOID
+enc_u32(encoder_t *enc, UINT32 value)
+{
+    memcpy(enc->buf + enc->len, &value, sizeof(UINT32));
+    enc->len += sizeof(UINT32);
+}
+
+VOID
+enc_begin(encoder_t *enc, UINT8 type)
+{
+    enc->mark = enc->len;
+    enc->buf[enc->len] = type;
+    enc->len += SEC_HEADER_SIZE;
+}
+
+// closes the open section, an empty one is dropped
+VOID
+enc_end(encoder_t *enc)
+{
+    UINT32 payload = enc->len - enc->mark - SEC_HEADER_SIZE;
+    if (!payload)
+    {
+        enc->len = enc->mark;
+        return;
+    }
+    memcpy(enc->buf + enc->mark + 1, &payload, sizeof(UINT32));
+}
+
+BOOL
+enc_full(encoder_t *enc)
+{
+    return enc->len + SEC_ROOM > enc->size;
+}
+
+// Asynchronous output. The encoders hand their full buffers over to
+// the writer, a Pin internal thread, and go on with a spare buffer of
+// the pool, so the application threads only wait for the driver once
+// every buffer of the pool is waiting to be written. The buffers are
+// written in the order they were handed over. All the buffers have the
+// size of the encoders, which no longer depends on the pipe.
+typedef struct
+{
+    UINT8 *buf;
+    UINT32 len;
+} async_item_t;
+
+BOOL async_mode;
+async_item_t *async_queue; // ring of the buffers to write
+UINT8 **async_spares; // stack of the spare buffers
+UINT32 async_nbufs; // the queued and the spare buffers, always
+UINT32 async_head, async_count, async_nspares;
+volatile BOOL async_exit;
+PIN_LOCK async_lock; // guards all of the above
+PIN_LOCK write_lock; // serializes the writer with the fallback writes
+PIN_SEMAPHORE async_ready; // set while the queue may not be empty
+PIN_SEMAPHORE async_spare; // set while there is a spare buffer
+PIN_SEMAPHORE async_idle; // set once the queue has been written out
+PIN_THREAD_UID async_uid;
+
+INT32
+async_init(UINT32 nbufs, UINT32 size)
+{
+    async_queue = (async_item_t *)malloc(nbufs * sizeof(async_item_t));
+    async_spares = (UINT8 **)malloc(nbufs * sizeof(UINT8 *));
+    if (!async_queue || !async_spares)
+        return -1;
+    for (UINT32 i = 0; i < nbufs; i++)
+    {
+        if ((async_spares[i] = (UINT8 *)malloc(size)) == NULL)
+            return -1;
+    }
+    async_nbufs = async_nspares = nbufs;
+    PIN_InitLock(&async_lock);
+    PIN_SemaphoreInit(&async_ready);
+    PIN_SemaphoreInit(&async_spare);
+    PIN_SemaphoreInit(&async_idle);
+    PIN_SemaphoreSet(&async_spare);
+    PIN_SemaphoreSet(&async_idle);
+    return 0;
+}
+
+/*
+ * The writer thread. It leaves only once it has been asked to and the
+ * queue is empty. The buffers are written without output_lock, which
+ * the application threads take in their own paths.
+ */
+VOID
+async_writer(VOID *arg)
+{
+    for (;;)
+    {
+        PIN_SemaphoreWait(&async_ready);
+        PIN_GetLock(&async_lock, PIN_ThreadId() + 1);
+        if (!async_count)
+        {
+            PIN_SemaphoreClear(&async_ready);
+            PIN_SemaphoreSet(&async_idle);
+            BOOL done = async_exit;
+            PIN_ReleaseLock(&async_lock);
+            if (done)
+                return;
+            continue;
+        }
+        async_item_t item = async_queue[async_head];
+        PIN_ReleaseLock(&async_lock);
+
+        // the time of the writer is not blocked_us, nothing waits
+        // for it but the threads that are out of buffers
+        PIN_GetLock(&write_lock, PIN_ThreadId() + 1);
+        pipe_write(item.buf, item.len);
+        PIN_ReleaseLock(&write_lock);
+
+        PIN_GetLock(&async_lock, PIN_ThreadId() + 1);
+        async_head = (async_head + 1) % async_nbufs;
+        async_count--;
+        async_spares[async_nspares++] = item.buf;
+        PIN_SemaphoreSet(&async_spare);
+        PIN_ReleaseLock(&async_lock);
+    }
+}
+
+/*
+ * Queues the buffer of the encoder and gives it a spare one, waiting
+ * for one if the pool is exhausted. Returns false once the writer has
+ * been stopped, the buffer must then be written by the caller.
+ */
+BOOL
+async_push(encoder_t *enc)
+{
+    PIN_GetLock(&async_lock, PIN_ThreadId() + 1);
+    if (!async_nspares && !async_exit)
+    {
+        UINT64 start = clock_us();
+        while (!async_nspares && !async_exit)
+        {
+            PIN_SemaphoreClear(&async_spare);
+            PIN_ReleaseLock(&async_lock);
+            PIN_SemaphoreWait(&async_spare);
+            PIN_GetLock(&async_lock, PIN_ThreadId() + 1);
+        }
+        stats.blocked_us += clock_us() - start;
+    }
+    if (async_exit)
+    {
+        // what has been queued goes first
+        PIN_ReleaseLock(&async_lock);
+        PIN_SemaphoreWait(&async_idle);
+        return false;
+    }
+
+    UINT8 *spare = async_spares[--async_nspares];
+    async_item_t *item = &async_queue[(async_head + async_count) % async_nbufs];
+    item->buf = enc->buf;
+    item->len = enc->len;
+    async_count++;
+    PIN_SemaphoreClear(&async_idle);
+    PIN_SemaphoreSet(&async_ready);
+    PIN_ReleaseLock(&async_lock);
+    enc->buf = spare;
+    return true;
+}
+
+// waits until everything that has been queued is written out
+VOID
+async_drain()
+{
+    if (async_mode)
+        PIN_SemaphoreWait(&async_idle);
+}
+
+/*
+ * Stops the writer before Pin exits, once the queue is empty. Late
+ * flushes, e.g. of pin_finish(), are written synchronously.
+ */
+VOID
+async_stop(VOID *v)
+{
+    PIN_GetLock(&async_lock, PIN_ThreadId() + 1);
+    async_exit = true;
+    PIN_SemaphoreSet(&async_ready);
+    PIN_SemaphoreSet(&async_spare);
+    PIN_ReleaseLock(&async_lock);
+    PIN_WaitForThreadTermination(async_uid, PIN_INFINITE_TIMEOUT, NULL);
+    async_mode = false;
+}
+
+VOID
+enc_flush(encoder_t *enc)
+{
+    if (!enc->len)
+        return;
+
+    if (!async_mode || !async_push(enc))
+    {
+        PIN_GetLock(&output_lock, PIN_ThreadId() + 1);
+        PIN_GetLock(&write_lock, PIN_ThreadId() + 1);
+        if(!output_closed)
+            write_to_pipe(enc->buf, enc->len);
+        PIN_ReleaseLock(&write_lock);
+        PIN_ReleaseLock(&output_lock);
+    }
+    enc->len = enc->mark = 0;
+}
+
+// encoder of the records that are written at the end of a run
+encoder_t flush_enc;
 
 bucket_t *
 init_bucket(int pipe_size)
@@ -85,7 +576,13 @@ init_bucket(int pipe_size)
     bkt->start = bkt->curr = (node_t *)malloc(bkt->size * sizeof(node_t));
     bkt->end = bkt->start + bkt->size;
     bkt->guard = 0x41424344;
-    if(bkt->start == NULL)
+    bkt->tag = 0;
+    bkt->next = NULL;
+    bkt->shadow.depth = 0;
+    bkt->crash.signal = 0;
+    bkt->fault = 0;
+    bkt->fault_signal = 0;
+    if(bkt->start == NULL || enc_init(&bkt->enc, pipe_size >> 1))
     {
         perror("malloc");
         return NULL;
@@ -93,47 +590,244 @@ init_bucket(int pipe_size)
     return bkt;
 }
 
+VOID
+free_bucket(bucket_t *bkt)
+{
+    free(bkt->start);
+    free(bkt->enc.buf);
+    free(bkt);
+}
+
+/*
+ * Encodes the nodes of the bucket into sections. Consecutive block
+ * or trace records of the thread form a single section, the offsets
+ * of the blocks are delta encoded since neighbouring blocks tend to
+ * be close to each other. Returns the number of block records.
+ */
+UINT64
+bucket_encode(bucket_t *bkt)
+{
+    encoder_t *enc = &bkt->enc;
+    UINT32 thread = (UINT32)(bkt->tag >> 32);
+    UINT8 type = 0;
+    UINT64 prev = 0;
+    UINT64 blocks = 0;
+
+    for (node_t *node = bkt->start; node < bkt->curr; node++)
+    {
+        if (node->image_index == MARKER_INDEX)
+        {
+            if (type)
+                enc_end(enc);
+            type = 0;
+            if (enc_full(enc))
+                enc_flush(enc);
+            enc_begin(enc, SEC_EVENT);
+            enc_u32(enc, thread);
+            enc_varint(enc, node->bbl);
+            enc_end(enc);
+            continue;
+        }
+
+        UINT32 index = (UINT32)node->image_index;
+        UINT8 kind = index == TRACE_INDEX ? SEC_TRACES : SEC_RAW;
+        if (kind != type || enc_full(enc))
+        {
+            if (type)
+                enc_end(enc);
+            if (enc_full(enc))
+                enc_flush(enc);
+            type = kind;
+            prev = 0;
+            enc_begin(enc, type);
+            enc_u32(enc, thread);
+        }
+
+        if (kind == SEC_TRACES)
+        {
+            enc_varint(enc, node->bbl);
+            continue;
+        }
+        enc_varint(enc, index);
+        enc_varint(enc, ZIGZAG(node->bbl - prev));
+        prev = node->bbl;
+        blocks++;
+    }
+
+    if (type)
+        enc_end(enc);
+
+    // a crash is reported once, after the blocks that led to it
+    crash_t *crash = &bkt->crash;
+    if (crash->signal)
+    {
+        if (enc->len + CRASH_ROOM > enc->size)
+            enc_flush(enc);
+
+        UINT32 len = (UINT32)strlen(crash->name);
+        enc_begin(enc, SEC_CRASH);
+        enc_u32(enc, thread);
+        enc_varint(enc, crash->signal);
+        enc_varint(enc, crash->image);
+        enc_varint(enc, crash->offset);
+        enc_varint(enc, crash->fault);
+        enc_varint(enc, crash->hash);
+        enc_varint(enc, crash->depth);
+        enc_varint(enc, len);
+        memcpy(enc->buf + enc->len, crash->name, len);
+        enc->len += len;
+        enc_end(enc);
+        crash->signal = 0;
+    }
+    return blocks;
+}
+
+VOID
+bucket_flush(bucket_t *bkt)
+{
+    if(bkt->curr == bkt->start)
+        return;
+
+    // the markers and the trace records are not blocks
+    UINT64 blocks = bucket_encode(bkt);
+    enc_flush(&bkt->enc);
+
+    PIN_GetLock(&output_lock, PIN_ThreadId() + 1);
+    bbls_count += blocks;
+    PIN_ReleaseLock(&output_lock);
+    bkt->curr = bkt->start;
+}
+
+VOID
+bucket_push(bucket_t *bkt, UINT64 image_index, UINT64 bbl)
+{
+    if(IS_BUCKET_FULL(bkt))
+        bucket_flush(bkt);
+
+    bkt->curr->image_index = image_index;
+    bkt->curr->bbl = bbl;
+    bkt->curr++;
+}
+
 /* Whitelisting */
+const char *
+path_basename(const char *path)
+{
+    const char *base = path;
+    for (const char *p = path; *p; p++)
+    {
+        if (*p == '/' || *p == '\\')
+            base = p + 1;
+    }
+    return base;
+}
+
+// FNV-1a
+UINT32
+name_hash(const char *name)
+{
+    UINT32 h = 2166136261U;
+    for (; *name; name++)
+        h = (h ^ (UINT8)*name) * 16777619U;
+    return h;
+}
+
+/*
+ * Rebuilds the sorted array of the address ranges of the loaded
+ * images. It is called on every load and unload, which are rare
+ * compared to the lookups done for every new trace.
+ */
+VOID
+wht_index_ranges()
+{
+    UINT32 n = 0;
+    for (off_t i=0; i < whitelist.len; i++)
+    {
+        image_t *img = whitelist.list + i;
+        if (!img->loaded)
+            continue;
+
+        // insertion sort, there are only a few whitelisted images
+        UINT32 j = n++;
+        for (; j > 0 && whitelist.ranges[j - 1].low > img->low; j--)
+            whitelist.ranges[j] = whitelist.ranges[j - 1];
+        whitelist.ranges[j].low = img->low;
+        whitelist.ranges[j].high = img->high;
+        whitelist.ranges[j].image = img;
+    }
+    whitelist.nranges = n;
+}
+
+/*
+ * Only the whitelist entries with the same basename as the image are
+ * candidates, so the cost of a module load does not depend on the
+ * size of the whitelist. The full entry must still be part of the
+ * path of the image.
+ */
 INT32
 wht_insert_image(image_t *image)
 {
     image_t *list = whitelist.list;
-    off_t i = 0;
-    for (i=0; i < whitelist.len; i++)
-    {
-        char *stub = (char *)strstr(
-                image->path,
-                list[i].path
-                );
+    const char *base = path_basename(image->path);
+    UINT32 slot = name_hash(base) & whitelist.names_mask;
 
-        // search other
-        if (stub == NULL)
+    for (; whitelist.names[slot] >= 0; slot = (slot + 1) & whitelist.names_mask)
+    {
+        INT32 i = whitelist.names[slot];
+        if (strcmp(base, path_basename(list[i].path)) ||
+                strstr(image->path, list[i].path) == NULL)
             continue;
 
         image->index = i;
-        // copy image metadata to whitelist
+        // copy image metadata to whitelist, the map
+        // survives an unload/reload of the same image.
+        image->map = list[i].map;
+        image->blocks = list[i].blocks;
+        image->filter = list[i].filter;
+        image->tcache = list[i].tcache;
+        image->idmp = list[i].idmp;
+        image->spans = list[i].spans;
         memcpy(list+i, image, sizeof(image_t));
+        wht_index_ranges();
         return 0;
     }
 
     return -1;
 }
 
+// returns the whitelist entry with the given basename, or -1
+INT32
+wht_find_basename(const char *base)
+{
+    UINT32 slot = name_hash(base) & whitelist.names_mask;
+    for (; whitelist.names[slot] >= 0; slot = (slot + 1) & whitelist.names_mask)
+    {
+        INT32 i = whitelist.names[slot];
+        if (!strcmp(base, path_basename(whitelist.list[i].path)))
+            return i;
+    }
+    return -1;
+}
+
 image_t *
 wht_find_image(ADDRINT bbl)
 {
-    image_t *list = whitelist.list;
-    off_t i = 0;
-    for (i=0; i < whitelist.len; i++)
-    {
-        if (!list[i].loaded)
-            continue;
+    range_t *ranges = whitelist.ranges;
+    UINT32 low = 0, high = whitelist.nranges;
 
-        if (list[i].low <= bbl && list[i].high >= bbl)
-           return list+i;
+    // find the last range that starts at or before bbl
+    while (low < high)
+    {
+        UINT32 mid = (low + high) / 2;
+        if (ranges[mid].low <= bbl)
+            low = mid + 1;
+        else
+            high = mid;
     }
 
-    return NULL;
+    if (low == 0 || ranges[low - 1].high < bbl)
+        return NULL;
+    return ranges[low - 1].image;
 }
 
 /*
@@ -154,11 +848,24 @@ wht_init(KNOB<std::string> *img_list)
             whitelist.len * sizeof(image_t)
             );
 
+    UINT32 names_size = 1;
+    while (names_size < 2 * whitelist.len)
+        names_size <<= 1;
+    whitelist.names_mask = names_size - 1;
+    whitelist.names = (INT32 *)malloc(names_size * sizeof(INT32));
+    whitelist.ranges = (range_t *)malloc(
+            (whitelist.len + 1) * sizeof(range_t)
+            );
+    whitelist.nranges = 0;
+
     // TODO: needs some better error
     // handling.
-    if (!whitelist.list)
+    if (!whitelist.list || !whitelist.names || !whitelist.ranges)
         LOG("Could not allocate whitelist\n");
 
+    for (UINT32 i=0; i < names_size; i++)
+        whitelist.names[i] = -1;
+
     // build an empty stub that
     // will be overwritten by the 
     // matching image if that image
@@ -171,6 +878,12 @@ wht_init(KNOB<std::string> *img_list)
     stub.high = 0;
     stub.loaded = 0;
     stub.path = NULL;
+    stub.map = NULL;
+    stub.blocks = NULL;
+    stub.filter = NULL;
+    stub.tcache = NULL;
+    stub.idmp = NULL;
+    stub.spans = NULL;
 
     for (i=0; i < whitelist.len; i++)
     {
@@ -178,387 +891,3062 @@ wht_init(KNOB<std::string> *img_list)
         stub.index = i;
         p = whitelist.list + i;
         memcpy(p, &stub, sizeof(image_t));
+
+        UINT32 slot = name_hash(path_basename(stub.path)) & whitelist.names_mask;
+        while (whitelist.names[slot] >= 0)
+            slot = (slot + 1) & whitelist.names_mask;
+        whitelist.names[slot] = (INT32)i;
     }
 }
 
 VOID
 wht_free()
 {
+    for (off_t i=0; i < whitelist.len; i++)
+    {
+        free(whitelist.list[i].map);
+        if (whitelist.list[i].blocks)
+            free(whitelist.list[i].blocks->list);
+        free(whitelist.list[i].blocks);
+        if (whitelist.list[i].filter)
+            free(whitelist.list[i].filter->list);
+        free(whitelist.list[i].filter);
+        if (whitelist.list[i].tcache)
+            free(whitelist.list[i].tcache->slots);
+        free(whitelist.list[i].tcache);
+    }
     free(whitelist.list);
+    free(whitelist.names);
+    free(whitelist.ranges);
 }
 
-/* Instrumentation */
-VOID
-img_load(IMG img, VOID *v)
-{
-    image_t image;
-    image.path = (char *)IMG_Name(img).c_str();
-    image.low = IMG_LowAddress(img);
-    image.high = IMG_HighAddress(img);
-    image.loaded = 1;
+/* IDA basic blocks */
+#define NO_BLOCK ((ADDRINT)-1)
 
-    LOG("[+] Image ");
-    LOG(image.path);
-    if(!wht_insert_image(&image))
-        LOG("loaded successfully\n");
-    else
-        LOG("skipped\n");
+// set if any image reports IDA blocks instead of Pin blocks
+BOOL ida_mode;
+
+INT32
+ida_block_compare(const void *a, const void *b)
+{
+    UINT32 x = ((const ida_block_t *)a)->start;
+    UINT32 y = ((const ida_block_t *)b)->start;
+    return x < y ? -1 : x > y;
 }
 
-VOID 
-img_unload(IMG img, VOID *v)
+/*
+ * Returns the offset of the IDA basic block that contains the
+ * offset of the Pin basic block, or NO_BLOCK. It is called once
+ * per block at instrumentation time.
+ */
+ADDRINT
+ida_block_offset(ida_blocks_t *blocks, ADDRINT offset)
 {
-    ADDRINT low = IMG_LowAddress(img);
-    image_t *i = wht_find_image(low);
-    if (i)
+    UINT32 low = 0, high = blocks->len;
+    while (low < high)
     {
-        LOG("[+] Unloading image ");
-        LOG(i->path);
-        LOG("\n");
-        i->loaded = 0;
+        UINT32 mid = (low + high) / 2;
+        if (blocks->list[mid].start <= offset)
+            low = mid + 1;
+        else
+            high = mid;
     }
+
+    if (low == 0)
+        return NO_BLOCK;
+    ida_block_t *block = blocks->list + low - 1;
+    if (block->start == offset || offset < block->end)
+        return block->start;
+    return NO_BLOCK;
 }
 
-VOID 
-bbl_hit_handler(image_t *img, ADDRINT ip)
+/*
+ * Instrumentation filter. With -range or -fn only the given spans of
+ * an image are instrumented, kept as offsets like the IDA blocks. A
+ * function is looked up in the .idmp of the image, where its span is
+ * made of all of its blocks, or else in the symbols of the image once
+ * it is loaded. An image that is named by neither is instrumented as
+ * a whole.
+ */
+typedef struct
 {
-#ifdef TARGET_WINDOWS
-    PIN_GetLock(PinThreadLock, 0);
-    if(IsProcessSignaled)
+    INT32 image; // index in the whitelist
+    const char *name;
+} filter_fn_t;
+
+filter_fn_t *filter_fns;
+UINT32 filter_nfns;
+
+INT32
+filter_add(image_t *img, UINT32 start, UINT32 end)
+{
+    ida_blocks_t *filter = img->filter;
+    if (filter == NULL)
+    {
+        filter = (ida_blocks_t *)calloc(1, sizeof(ida_blocks_t));
+        if (filter == NULL)
+            return -1;
+        img->filter = filter;
+    }
+    if (start >= end)
+        return 0;
+
+    // the list doubles whenever its length is a power of two
+    if (!(filter->len & (filter->len - 1)))
+    {
+        UINT32 size = filter->len ? filter->len * 2 : 1;
+        ida_block_t *list = (ida_block_t *)realloc(filter->list,
+                size * sizeof(ida_block_t));
+        if (list == NULL)
+            return -1;
+        filter->list = list;
+    }
+    filter->list[filter->len].start = start;
+    filter->list[filter->len].end = end;
+    filter->len++;
+    return 0;
+}
+
+/*
+ * Sorts the spans and merges the ones that overlap or touch, so that
+ * ida_block_offset() finds the span of an offset.
+ */
+VOID
+filter_sort(ida_blocks_t *filter)
+{
+    if (filter == NULL || filter->len == 0)
         return;
-#endif /* TARGET_WINDOWS */
 
-    if(IS_BUCKET_FULL(bucket))
+    qsort(filter->list, filter->len, sizeof(ida_block_t), ida_block_compare);
+    UINT32 n = 0;
+    for (UINT32 i = 1; i < filter->len; i++)
     {
-        write_to_pipe(bucket->start, (bucket->end - bucket->start) * sizeof(node_t));
-        bucket->curr = bucket->start;
+        ida_block_t *last = filter->list + n;
+        if (filter->list[i].start <= last->end)
+        {
+            if (filter->list[i].end > last->end)
+                last->end = filter->list[i].end;
+            continue;
+        }
+        filter->list[++n] = filter->list[i];
     }
+    filter->len = n + 1;
+}
 
-    bucket->curr->image_index = img->index;
-    bucket->curr->bbl = (UINT64)(ip - img->low);
-    bucket->curr++;
+// the whitelist index of the image of an "image:spec" knob value, or -1
+INT32
+filter_split(const char *value, const char **spec)
+{
+    const char *colon = strrchr(value, ':');
+    if (colon == NULL)
+        return -1;
 
-    bbls_count++;
+    std::string image(value, colon - value);
+    *spec = colon + 1;
+    return wht_find_basename(path_basename(image.c_str()));
+}
 
-#ifdef TARGET_WINDOWS
-    PIN_ReleaseLock(PinThreadLock);
-#endif /* TARGET_WINDOWS */
+VOID
+filter_init(KNOB<std::string> *ranges, KNOB<std::string> *functions)
+{
+    for (UINT32 i = 0; i < ranges->NumberOfValues(); i++)
+    {
+        const char *spec;
+        unsigned long start, end;
+        INT32 index = filter_split(ranges->Value(i).c_str(), &spec);
+        if (index < 0 || sscanf(spec, "%lx-%lx", &start, &end) != 2 ||
+                filter_add(whitelist.list + index, (UINT32)start, (UINT32)end))
+        {
+            LOG("[!] Invalid range ");
+            LOG(ranges->Value(i).c_str());
+            LOG("\n");
+        }
+    }
+
+    filter_fns = (filter_fn_t *)malloc(
+            (functions->NumberOfValues() + 1) * sizeof(filter_fn_t));
+    for (UINT32 i = 0; filter_fns && i < functions->NumberOfValues(); i++)
+    {
+        const char *name;
+        INT32 index = filter_split(functions->Value(i).c_str(), &name);
+        if (index < 0 || filter_add(whitelist.list + index, 0, 0))
+        {
+            LOG("[!] Invalid function ");
+            LOG(functions->Value(i).c_str());
+            LOG("\n");
+            continue;
+        }
+        filter_fns[filter_nfns].image = index;
+        filter_fns[filter_nfns].name = name;
+        filter_nfns++;
+    }
+}
+
+// set if the function of an IDA block of the image has been asked for
+BOOL
+filter_wants(image_t *img, const char *name)
+{
+    for (UINT32 i = 0; i < filter_nfns; i++)
+    {
+        if (whitelist.list + filter_fns[i].image == img &&
+                !strcmp(filter_fns[i].name, name))
+            return true;
+    }
+    return false;
 }
 
+/*
+ * Adds the functions of a loaded image that has no .idmp from its
+ * symbols.
+ */
 VOID
-trace_callback(TRACE trace, VOID *v)
+filter_symbols(IMG img, image_t *im)
 {
-    // get trace's address and check
-    // if the image it belongs to has
-    // been whitelisted.
-    ADDRINT addr = TRACE_Address(trace);
-    image_t *im = wht_find_image(addr);
-    if (!im)
+    if (im->filter == NULL || im->blocks)
         return;
 
-    // add instrumentation to all basic blocks
-    // in the current trace.
-    BBL bbl = TRACE_BblHead(trace);
-    for (; BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    for (UINT32 i = 0; i < filter_nfns; i++)
     {
-        addr = BBL_Address(bbl);
+        if (whitelist.list + filter_fns[i].image != im)
+            continue;
 
-        // enable tracing of this
-        // basic block.
-        BBL_InsertCall(
-                bbl,
-                IPOINT_ANYWHERE,
-                (AFUNPTR)bbl_hit_handler,
-                IARG_FAST_ANALYSIS_CALL,
-                IARG_PTR,
-                im,
-                IARG_ADDRINT,
-                addr,
-                IARG_END
-                );
+        RTN rtn = RTN_FindByName(img, filter_fns[i].name);
+        if (!RTN_Valid(rtn))
+        {
+            LOG("[!] Function ");
+            LOG(filter_fns[i].name);
+            LOG(" not found\n");
+            continue;
+        }
+        UINT32 start = (UINT32)(RTN_Address(rtn) - im->low);
+        filter_add(im, start, start + (UINT32)RTN_Size(rtn));
     }
+    filter_sort(im->filter);
 }
 
-void
-context_change_cb(THREADID thridx, CONTEXT_CHANGE_REASON reason, const CONTEXT *from, CONTEXT *to, INT32 info, VOID *v) 
+/*
+ * Loads the #BBLS# section of a .idmp dump of disassembler/prepare.py
+ * and attaches it to the whitelisted image named in its #IMAGE#
+ * section.
+ */
+INT32
+idmp_load(const char *path)
 {
-    switch(reason)
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
     {
-        case CONTEXT_CHANGE_REASON_FATALSIGNAL:
-            if(IS_BUCKET_FULL(bucket))
+        perror("fopen");
+        return -1;
+    }
+
+    char line[1024];
+    char name[1024] = "";
+    int mode = 0;
+    ida_blocks_t *blocks = (ida_blocks_t *)calloc(1, sizeof(ida_blocks_t));
+    UINT32 size = 0;
+    image_t *target = NULL; // of the -fn functions
+
+    while (blocks && fgets(line, sizeof(line), fp))
+    {
+        if (strchr(line, '#'))
+        {
+            mode = strstr(line, "#IMAGE#") ? 1 : strstr(line, "#BBLS#") ? 2 : 0;
+            INT32 index = wht_find_basename(path_basename(name));
+            if (mode == 2 && index >= 0 && whitelist.list[index].filter)
+                target = whitelist.list + index;
+            continue;
+        }
+
+        if (mode == 1)
+        {
+            // base,name
+            char *comma = strchr(line, ',');
+            if (comma)
             {
-                write_to_pipe(bucket->start, (bucket->end - bucket->start) * sizeof(node_t));
-                bucket->curr = bucket->start;
+                strncpy(name, comma + 1, sizeof(name) - 1);
+                name[strcspn(name, "\r\n")] = 0;
             }
-            bucket->curr->image_index = 0xFFFFFFFFFFFFFFFF;
-            bucket->curr->bbl = (UINT64)info;
-            bucket->curr++;
-            break;
-        case CONTEXT_CHANGE_REASON_EXCEPTION:
-            #define IS_FATAL_EXCEPTION(ex) ((ex & 0xC0000000) == 0xC0000000)
-            if(IS_FATAL_EXCEPTION(info))
+        }
+        else if (mode == 2)
+        {
+            // 0xstart,0xend,function
+            unsigned long start, end;
+            if (sscanf(line, "%lx,%lx", &start, &end) != 2)
+                continue;
+
+            if (blocks->len == size)
             {
-                if(IS_BUCKET_FULL(bucket))
-                {
-                    write_to_pipe(bucket->start, (bucket->end - bucket->start) * sizeof(node_t));
-                    bucket->curr = bucket->start;
-                }
-                bucket->curr->image_index = 0xFFFFFFFFFFFFFFFF;
-                bucket->curr->bbl = (UINT64)info;
-                bucket->curr++;
+                size = size ? size * 2 : 0x1000;
+                ida_block_t *list = (ida_block_t *)realloc(
+                        blocks->list, size * sizeof(ida_block_t));
+                if (list == NULL)
+                    break;
+                blocks->list = list;
             }
-            break;
-        default:
-            break;
+            blocks->list[blocks->len].start = (UINT32)start;
+            blocks->list[blocks->len].end = (UINT32)end;
+            blocks->len++;
+
+            char *function = strchr(strchr(line, ',') + 1, ',');
+            if (target && function)
+            {
+                function[strcspn(function, "\r\n")] = 0;
+                if (filter_wants(target, function + 1))
+                    filter_add(target, (UINT32)start, (UINT32)end);
+            }
+        }
+    }
+    fclose(fp);
+
+    INT32 i = wht_find_basename(path_basename(name));
+    if (blocks == NULL || i < 0 || whitelist.list[i].blocks)
+    {
+        LOG("[!] Could not load ");
+        LOG(path);
+        LOG("\n");
+        if (blocks)
+            free(blocks->list);
+        free(blocks);
+        return -1;
     }
+
+    qsort(blocks->list, blocks->len, sizeof(ida_block_t), ida_block_compare);
+    whitelist.list[i].blocks = blocks;
+    ida_mode = true;
+    return 0;
 }
 
-/* Windows specific code */
+/*
+ * With the trace cache, the .idmp of an image is only parsed once the
+ * cache misses. Only its #IMAGE# section is read here. The dumps of
+ * the images with a -fn filter are needed up front.
+ */
+INT32
+idmp_defer(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        perror("fopen");
+        return -1;
+    }
+
+    char line[1024];
+    char name[1024] = "";
+    int mode = 0;
+    while (fgets(line, sizeof(line), fp) && !strstr(line, "#BBLS#"))
+    {
+        if (strchr(line, '#'))
+        {
+            mode = strstr(line, "#IMAGE#") ? 1 : 0;
+            continue;
+        }
+        char *comma = strchr(line, ',');
+        if (mode == 1 && comma)
+        {
+            strncpy(name, comma + 1, sizeof(name) - 1);
+            name[strcspn(name, "\r\n")] = 0;
+        }
+    }
+    fclose(fp);
+
+    INT32 i = wht_find_basename(path_basename(name));
+    if (i < 0 || whitelist.list[i].filter || whitelist.list[i].idmp)
+        return idmp_load(path);
+    whitelist.list[i].idmp = path;
+    ida_mode = true;
+    return 0;
+}
+
+VOID
+idmp_resume(image_t *im)
+{
+    const char *path = im->idmp;
+    im->idmp = NULL;
+    LOG("[+] Loading ");
+    LOG(path);
+    LOG("\n");
+    idmp_load(path);
+}
+
+/* Deduplication */
+#define MAP_SIZE(img) ((img)->high - (img)->low + 1)
+
+/*
+ * Allocates a dense map with one counter for every byte
+ * of the image, since a basic block may start at any offset.
+ * The map is indexed directly by the offset of the block, so
+ * recording a hit is a single store. Pages of the map that
+ * are never touched are never committed by the OS.
+ */
+INT32
+map_alloc(image_t *img)
+{
+    if (img->map)
+        return 0;
+
+    img->map = (UINT8 *)calloc(MAP_SIZE(img), sizeof(UINT8));
+    if (img->map == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+    return 0;
+}
+
+/* Trace metadata cache */
+
+// With -tcache, what every Pin basic block of a whitelisted image
+// resolves to, i.e. the block that is reported, none, or that it is
+// filtered out, is kept in <dir>/<image>.tcache across runs. The file
+// is keyed on the identity of the image file and the options it depends on,
+// so a rebuilt image or a different filter starts over. The blocks of
+// the known traces then cost a hash lookup at instrumentation time,
+// and the .idmp of the image is not parsed at all unless a trace that
+// no run has seen before is compiled. The code cache of Pin itself
+// cannot be kept, the traces are still compiled in every run.
+#define TCACHE_MAGIC 0x43544843 // "CHTC"
+#define TCACHE_VERSION 1
+#define TCACHE_EMPTY 0xFFFFFFFF
+#define TCACHE_MIN_SLOTS 1024
+#define FILTERED_BLOCK ((ADDRINT)-2)
+
+const char *tcache_dir;
+UINT64 tcache_config; // hash of the options the resolution depends on
+
+// FNV-1a, 64 bits
+UINT64
+hash64(UINT64 h, const VOID *data, size_t len)
+{
+    const UINT8 *p = (const UINT8 *)data;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+/*
+ * Hashes what identifies the file of an image at little cost: its size,
+ * its modification time and its first page, which holds the ELF or PE
+ * headers, along with the PE TimeDateStamp and usually the ELF build-id.
+ * Returns 0 if the file cannot be read, such a cache is never reused.
+ */
+UINT64
+image_identity(const char *path, UINT64 h)
+{
+#ifdef TARGET_LINUX
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return 0;
+    UINT64 size = (UINT64)st.st_size;
+    UINT64 mtime = (UINT64)st.st_mtime;
+#elif TARGET_WINDOWS
+    WIN32_API::WIN32_FILE_ATTRIBUTE_DATA attrs;
+    if (!WIN32_API::GetFileAttributesExA(path,
+                WIN32_API::GetFileExInfoStandard, &attrs))
+        return 0;
+    UINT64 size = ((UINT64)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow;
+    UINT64 mtime = ((UINT64)attrs.ftLastWriteTime.dwHighDateTime << 32) |
+        attrs.ftLastWriteTime.dwLowDateTime;
+#endif
+    h = hash64(h, &size, sizeof(size));
+    h = hash64(h, &mtime, sizeof(mtime));
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return 0;
+    UINT8 page[0x1000];
+    size_t n = fread(page, 1, sizeof(page), fp);
+    fclose(fp);
+    return hash64(h, page, n);
+}
+
+std::string
+tcache_path(image_t *im)
+{
+    return std::string(tcache_dir) + "/" + path_basename(im->path) + ".tcache";
+}
+
+tcache_entry_t *
+tcache_slot(tcache_t *tc, UINT32 bbl)
+{
+    UINT32 slot = (bbl * 2654435761U) & tc->mask;
+    while (tc->slots[slot].bbl != TCACHE_EMPTY && tc->slots[slot].bbl != bbl)
+        slot = (slot + 1) & tc->mask;
+    return tc->slots + slot;
+}
+
+INT32
+tcache_resize(tcache_t *tc, UINT32 size)
+{
+    tcache_entry_t *old = tc->slots;
+    UINT32 old_size = old ? tc->mask + 1 : 0;
+
+    tc->slots = (tcache_entry_t *)malloc(size * sizeof(tcache_entry_t));
+    if (tc->slots == NULL)
+    {
+        tc->slots = old;
+        return -1;
+    }
+    memset(tc->slots, 0xFF, size * sizeof(tcache_entry_t));
+    tc->mask = size - 1;
+    for (UINT32 i = 0; i < old_size; i++)
+    {
+        if (old[i].bbl != TCACHE_EMPTY)
+            *tcache_slot(tc, old[i].bbl) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+VOID
+tcache_insert(tcache_t *tc, UINT32 bbl, UINT32 block)
+{
+    // at most 3/4 full
+    if ((tc->len + 1) * 4 > (tc->mask + 1) * 3 &&
+            tcache_resize(tc, (tc->mask + 1) * 2))
+        return;
+
+    tcache_entry_t *entry = tcache_slot(tc, bbl);
+    if (entry->bbl == TCACHE_EMPTY)
+        tc->len++;
+    entry->bbl = bbl;
+    entry->block = block;
+}
+
+/*
+ * Attaches the cache of the previous runs to a whitelisted image that
+ * has just been loaded, or an empty one. The .idmp of the image is
+ * parsed right away when there is nothing to reuse.
+ */
+VOID
+tcache_load(image_t *im)
+{
+    if (im->tcache == NULL)
+    {
+        tcache_t *tc = (tcache_t *)calloc(1, sizeof(tcache_t));
+        if (tc == NULL || tcache_resize(tc, TCACHE_MIN_SLOTS))
+        {
+            LOG("[!] Could not allocate the trace cache\n");
+            free(tc);
+            if (im->idmp)
+                idmp_resume(im);
+            return;
+        }
+
+        // the key is the identity of the image file, which must not
+        // cost a full read of it on every run
+        tc->key = image_identity(im->path, tcache_config);
+        im->tcache = tc;
+
+        std::string path = tcache_path(im);
+        FILE *fp = fopen(path.c_str(), "rb");
+        UINT32 header[2];
+        UINT64 key;
+        UINT32 count;
+        if (tc->key && fp && fread(header, sizeof(header), 1, fp) == 1 &&
+                header[0] == TCACHE_MAGIC && header[1] == TCACHE_VERSION &&
+                fread(&key, sizeof(key), 1, fp) == 1 && key == tc->key &&
+                fread(&count, sizeof(count), 1, fp) == 1)
+        {
+            tcache_entry_t entry;
+            for (UINT32 i = 0; i < count; i++)
+            {
+                if (fread(&entry, sizeof(entry), 1, fp) != 1)
+                    break;
+                tcache_insert(tc, entry.bbl, entry.block);
+            }
+            tc->saved = tc->len;
+        }
+        if (fp)
+            fclose(fp);
+    }
+
+    if (!im->tcache->len && im->idmp)
+        idmp_resume(im);
+}
+
+/*
+ * Writes the caches that have grown since they were loaded. Every run
+ * writes a file of its own first, so that the workers of a campaign
+ * never see a partial one.
+ */
+VOID
+tcache_save()
+{
+    for (off_t i = 0; i < whitelist.len; i++)
+    {
+        tcache_t *tc = whitelist.list[i].tcache;
+        if (tc == NULL || !tc->key || tc->len == tc->saved)
+            continue;
+
+        std::string path = tcache_path(whitelist.list + i);
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%d", (int)PIN_GetPid());
+        std::string temp = path + suffix;
+        FILE *fp = fopen(temp.c_str(), "wb");
+        if (fp == NULL)
+        {
+            perror("fopen");
+            continue;
+        }
+
+        UINT32 header[2] = {TCACHE_MAGIC, TCACHE_VERSION};
+        BOOL ok = fwrite(header, sizeof(header), 1, fp) == 1 &&
+            fwrite(&tc->key, sizeof(tc->key), 1, fp) == 1 &&
+            fwrite(&tc->len, sizeof(tc->len), 1, fp) == 1;
+        for (UINT32 j = 0; ok && j <= tc->mask; j++)
+        {
+            if (tc->slots[j].bbl != TCACHE_EMPTY)
+                ok = fwrite(tc->slots + j, sizeof(tcache_entry_t), 1, fp) == 1;
+        }
+        ok = !fclose(fp) && ok;
 #ifdef TARGET_WINDOWS
+        // rename() does not replace a file on Windows
+        if (ok)
+            remove(path.c_str());
+#endif /* TARGET_WINDOWS */
+        if (!ok || rename(temp.c_str(), path.c_str()))
+        {
+            LOG("[!] Could not write the trace cache\n");
+            remove(temp.c_str());
+            continue;
+        }
+        tc->saved = tc->len;
+    }
+}
 
-#define EVENT_WAIT_TIMEOUT 500
-/* Checks whether a time out event has been triggered. If that's the case
- * it flushes the data from buckets into the pipe and returns.
+/*
+ * Returns the offset of the block to report for the Pin basic block
+ * at the offset, NO_BLOCK if there is none or FILTERED_BLOCK if it is
+ * not to be instrumented at all.
+ */
+ADDRINT
+bbl_resolve(image_t *im, ADDRINT offset)
+{
+    tcache_t *tc = im->tcache;
+    if (tc)
+    {
+        tcache_entry_t *entry = tcache_slot(tc, (UINT32)offset);
+        if (entry->bbl != TCACHE_EMPTY)
+        {
+            if (entry->block >= (UINT32)FILTERED_BLOCK)
+                return entry->block == (UINT32)NO_BLOCK ? NO_BLOCK
+                                                        : FILTERED_BLOCK;
+            return entry->block;
+        }
+        if (im->idmp)
+            idmp_resume(im);
+    }
+
+    ADDRINT block = offset;
+    if (im->filter && ida_block_offset(im->filter, offset) == NO_BLOCK)
+        block = FILTERED_BLOCK;
+    else if (im->blocks)
+    {
+        block = ida_block_offset(im->blocks, offset);
+        if (block != NO_BLOCK && block >= MAP_SIZE(im))
+            block = NO_BLOCK;
+    }
+
+    if (tc)
+        tcache_insert(tc, (UINT32)offset, (UINT32)block);
+    return block;
+}
+
+/* Execution budget */
+
+// With -timeout (milliseconds of wall clock or, with -cputime, of CPU
+// time) or -bblimit, the pintool ends a run on its own instead of
+// waiting for the driver: the timeout marker is recorded, the trace
+// is flushed at exit and the application exits. The budget is armed
+// at the start of every run, i.e. per child of the fork server and
+// per persistent iteration.
+#define TIMEOUT_MARKER 0xC // SIGUSR2, what the driver sends on timeout
+#define WATCHDOG_MAX_SLICE 500
+
+UINT32 timeout_ms;
+BOOL timeout_cpu;
+UINT64 bbl_limit;
+volatile INT64 bbl_budget;
+volatile BOOL budget_armed;
+volatile UINT64 budget_start;
+BOOL budget_expired;
+PIN_LOCK budget_lock;
+
+// milliseconds of wall clock, or of CPU time of the process
+UINT64
+clock_ms(BOOL cpu)
+{
+#ifdef TARGET_LINUX
+    struct timespec ts;
+    clock_gettime(cpu ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#elif TARGET_WINDOWS
+    using namespace WIN32_API;
+    if (!cpu)
+        return GetTickCount64();
+
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (k.QuadPart + u.QuadPart) / 10000; // 100ns units
+#endif
+}
+
+// a monotonic clock in microseconds, for the statistics
+UINT64
+clock_us()
+{
+#ifdef TARGET_LINUX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#elif TARGET_WINDOWS
+    using namespace WIN32_API;
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (UINT64)(now.QuadPart / freq.QuadPart * 1000000 +
+            now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#endif
+}
+
+VOID
+budget_arm()
+{
+    bbl_budget = (INT64)bbl_limit;
+    budget_start = clock_ms(timeout_cpu);
+    budget_armed = true;
+}
+
+VOID
+budget_disarm()
+{
+    budget_armed = false;
+}
+
+BOOL
+budget_timed_out()
+{
+    return timeout_ms && budget_armed &&
+        clock_ms(timeout_cpu) - budget_start >= timeout_ms;
+}
+
+/*
+ * Records the timeout marker in the given bucket and makes the
+ * application exit; the fini callback writes the trace.
+ */
+VOID
+budget_expire(bucket_t *bkt)
+{
+    PIN_GetLock(&budget_lock, PIN_ThreadId() + 1);
+    BOOL expired = budget_expired;
+    budget_expired = true;
+    PIN_ReleaseLock(&budget_lock);
+    if (expired)
+        return;
+
+    LOG("[!] Execution budget expired\n");
+    bucket_push(bkt, MARKER_INDEX, TIMEOUT_MARKER);
+    PIN_ExitApplication(0);
+}
+
+/*
+ * The blocks are counted per trace that starts executing, so the
+ * limit is approximate; it is an inlinable check at every trace
+ * head instead of a call per block. Threads may race on the
+ * counter, which only widens the limit a little.
+ */
+ADDRINT PIN_FAST_ANALYSIS_CALL
+bbl_budget_check(UINT32 count)
+{
+    bbl_budget -= count;
+    return bbl_budget <= 0;
+}
+
+VOID
+bbl_budget_handler(bucket_t *bkt)
+{
+    // between two persistent iterations nothing is measured
+    if (!budget_armed)
+    {
+        bbl_budget = (INT64)bbl_limit;
+        return;
+    }
+    budget_expire(bkt);
+}
+
+UINT32
+watchdog_slice()
+{
+    UINT32 slice = timeout_ms / 16;
+    if (slice < 1)
+        slice = 1;
+    return slice > WATCHDOG_MAX_SLICE ? WATCHDOG_MAX_SLICE : slice;
+}
+
+#ifdef TARGET_LINUX
+/*
+ * Internal thread that enforces -timeout. The global bucket is only
+ * touched by the application threads at exit, the thread buckets are
+ * flushed then.
+ */
+VOID
+watchdog(VOID *arg)
+{
+    UINT32 slice = watchdog_slice();
+    while (IsProcessRunning)
+    {
+        PIN_Sleep(slice);
+        if (budget_timed_out())
+        {
+            IsProcessRunning = false;
+            budget_expire(bucket);
+        }
+    }
+}
+#endif /* TARGET_LINUX */
+
+/* Signal the interal pin thread that the process is exiting
+ * wait the thread to terminate.
+ */
+VOID
+TerminateInternalPINThreads(VOID *dummy)
+{
+    LOG("Waiting for the internal thread\n");
+    IsProcessRunning = false;
+    PIN_WaitForThreadTermination(InternalPINThreadUid, PIN_INFINITE_TIMEOUT, NULL);
+    LOG("The internal thread has finished.\n");
+}
+
+/* Instrumentation */
+
+// The whitelist lookup of every loaded image by IMG_Id(): the index of
+// its whitelist entry + 1, -1 if it is not whitelisted, or 0 if it is
+// unknown. Pin runs the image and the trace callbacks one at a time.
+INT32 *img_ids;
+UINT32 img_ids_len;
+
+VOID
+img_ids_set(UINT32 id, INT32 value)
+{
+    if (id >= img_ids_len)
+    {
+        UINT32 len = img_ids_len ? img_ids_len : 64;
+        while (len <= id)
+            len *= 2;
+        INT32 *ids = (INT32 *)realloc(img_ids, len * sizeof(INT32));
+        if (ids == NULL)
+            return;
+        memset(ids + img_ids_len, 0, (len - img_ids_len) * sizeof(INT32));
+        img_ids = ids;
+        img_ids_len = len;
+    }
+    img_ids[id] = value;
+}
+
+VOID
+img_load(IMG img, VOID *v)
+{
+    image_t image;
+    image.path = (char *)IMG_Name(img).c_str();
+    image.low = IMG_LowAddress(img);
+    image.high = IMG_HighAddress(img);
+    image.loaded = 1;
+    image.map = NULL;
+    image.blocks = NULL;
+    image.filter = NULL;
+    image.tcache = NULL;
+    image.idmp = NULL;
+
+    LOG("[+] Image ");
+    LOG(image.path);
+    INT32 id = 0;
+    if(!wht_insert_image(&image))
+    {
+        LOG("loaded successfully\n");
+        if(dedup_mode && map_alloc(whitelist.list + image.index))
+            LOG("[!] Could not allocate map\n");
+        filter_symbols(img, whitelist.list + image.index);
+        if(tcache_dir)
+            tcache_load(whitelist.list + image.index);
+        id = image.index + 1;
+    }
+    else
+    {
+        LOG("skipped\n");
+        id = -1;
+    }
+    img_ids_set(IMG_Id(img), id);
+
+    forksrv_hook(img);
+    cmp_hook(img);
+}
+
+VOID 
+img_unload(IMG img, VOID *v)
+{
+    ADDRINT low = IMG_LowAddress(img);
+    image_t *i = wht_find_image(low);
+    if (i)
+    {
+        LOG("[+] Unloading image ");
+        LOG(i->path);
+        LOG("\n");
+        i->loaded = 0;
+        wht_index_ranges();
+        img_ids_set(IMG_Id(img), 0);
+    }
+}
+
+/*
+ * The hot path of the streaming mode is split in a tiny check that
+ * Pin inlines, a rare flush and an unconditional store that Pin
+ * inlines as well. No locking is needed, the bucket belongs to the
+ * current thread.
+ */
+ADDRINT PIN_FAST_ANALYSIS_CALL
+bucket_is_full(bucket_t *bkt)
+{
+    return IS_BUCKET_FULL(bkt);
+}
+
+VOID
+bucket_full_handler(bucket_t *bkt)
+{
+    bucket_flush(bkt);
+}
+
+VOID PIN_FAST_ANALYSIS_CALL
+bbl_hit_handler(bucket_t *bkt, UINT64 image_index, UINT64 offset)
+{
+    node_t *node = bkt->curr;
+    node->image_index = bkt->tag | image_index;
+    node->bbl = offset;
+    bkt->curr = node + 1;
+}
+
+/*
+ * The location of a block must not depend on the load address
+ * of its image, so that edges are comparable between runs.
+ */
+ADDRINT
+edge_location(image_t *img, ADDRINT ip)
+{
+    UINT32 key = (UINT32)(ip - img->low) ^ (img->index << 24);
+    return (ADDRINT)((key * 2654435761U) >> (32 - EDGE_MAP_BITS));
+}
+
+ADDRINT PIN_FAST_ANALYSIS_CALL
+edge_hit_handler(ADDRINT cur_loc, ADDRINT prev_loc)
+{
+    // the counter may wrap on very hot edges; the
+    // same compromise is made by AFL.
+    edge_map[cur_loc ^ prev_loc]++;
+    return cur_loc >> 1;
+}
+
+VOID
+thread_start(THREADID thridx, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    if (edge_mode)
+        PIN_SetContextReg(ctxt, prev_loc_reg, 0);
+
+    bucket_t *bkt = init_bucket(bucket_size);
+    if (bkt == NULL)
+    {
+        LOG("[!] Could not allocate thread bucket\n");
+        PIN_ExitProcess(1);
+    }
+    bkt->tag = THREAD_INDEX(thridx, 0);
+    PIN_SetThreadData(bucket_key, bkt, thridx);
+    PIN_SetContextReg(ctxt, bucket_reg, (ADDRINT)bkt);
+
+    PIN_GetLock(&output_lock, thridx + 1);
+    bkt->next = thread_buckets;
+    thread_buckets = bkt;
+    stats.threads++;
+    PIN_ReleaseLock(&output_lock);
+}
+
+VOID
+thread_fini(THREADID thridx, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    bucket_t *bkt = (bucket_t *)PIN_GetThreadData(bucket_key, thridx);
+    if (bkt == NULL)
+        return;
+
+    bucket_flush(bkt);
+
+    PIN_GetLock(&output_lock, thridx + 1);
+    bucket_t **p = &thread_buckets;
+    while (*p && *p != bkt)
+        p = &(*p)->next;
+    if (*p)
+        *p = bkt->next;
+    PIN_ReleaseLock(&output_lock);
+
+    PIN_SetThreadData(bucket_key, NULL, thridx);
+    free_bucket(bkt);
+}
+
+VOID PIN_FAST_ANALYSIS_CALL
+shadow_call(bucket_t *bkt, UINT64 site)
+{
+    shadow_t *shadow = &bkt->shadow;
+    shadow->frames[shadow->depth & (SHADOW_DEPTH - 1)] = site;
+    shadow->depth++;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL
+shadow_ret(bucket_t *bkt)
+{
+    // returns without a call, e.g. of the entry routine, are ignored
+    bkt->shadow.depth -= (bkt->shadow.depth != 0);
+}
+
+/*
+ * Instruments the call or the return that ends the block, if any.
+ */
+VOID
+shadow_instrument(BBL bbl, image_t *im)
+{
+    INS tail = BBL_InsTail(bbl);
+    if (INS_IsCall(tail))
+    {
+        UINT64 site = ((UINT64)im->index << 32) |
+            (UINT32)(INS_Address(tail) - im->low);
+        INS_InsertCall(
+                tail,
+                IPOINT_BEFORE,
+                (AFUNPTR)shadow_call,
+                IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE,
+                bucket_reg,
+                IARG_UINT64,
+                site,
+                IARG_END
+                );
+    }
+    else if (INS_IsRet(tail))
+    {
+        INS_InsertCall(
+                tail,
+                IPOINT_BEFORE,
+                (AFUNPTR)shadow_ret,
+                IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE,
+                bucket_reg,
+                IARG_END
+                );
+    }
+}
+
+/*
+ * The entry of a comparison site, hashed like the edges.
+ */
+UINT32
+cmp_slot(UINT64 site)
+{
+    UINT32 key = (UINT32)site ^ ((UINT32)(site >> 32) << 24);
+    return (key * 2654435761U) >> (32 - CMP_TABLE_BITS);
+}
+
+/*
+ * Records a pair of operands in the entry of their site, unless the
+ * entry already has it. Threads may race on an entry, the table only
+ * feeds the mutators so an occasional torn pair is harmless.
+ */
+VOID
+cmp_record(cmp_entry_t *entry, const UINT8 *a, const UINT8 *b, UINT32 len)
+{
+    for (UINT32 i = 0; i < entry->count && i < CMP_PAIRS; i++)
+    {
+        if (entry->len[i] == len && !memcmp(entry->ops[i][0], a, len) &&
+                !memcmp(entry->ops[i][1], b, len))
+            return;
+    }
+
+    UINT32 i = entry->count++ % CMP_PAIRS;
+    entry->len[i] = (UINT8)len;
+    memcpy(entry->ops[i][0], a, len);
+    memcpy(entry->ops[i][1], b, len);
+}
+
+VOID PIN_FAST_ANALYSIS_CALL
+cmp_handler(cmp_entry_t *entry, UINT32 flags, ADDRINT a, ADDRINT b)
+{
+    UINT32 size = flags & CMP_SIZE_MASK;
+    UINT64 va = a, vb = b;
+
+    // x86 is little endian, the bytes of the values are the bytes
+    // of the operands in memory.
+    if (flags & CMP_MEM0)
+    {
+        va = 0;
+        PIN_SafeCopy(&va, (VOID *)a, size);
+    }
+    if (flags & CMP_MEM1)
+    {
+        vb = 0;
+        PIN_SafeCopy(&vb, (VOID *)b, size);
+    }
+    if (size < sizeof(UINT64))
+    {
+        va &= (1ULL << (size * 8)) - 1;
+        vb &= (1ULL << (size * 8)) - 1;
+    }
+
+    if (va != vb)
+        cmp_record(entry, (UINT8 *)&va, (UINT8 *)&vb, size);
+}
+
+/*
+ * Handles a call of a routine of the memcmp() family. Only the calls
+ * from the whitelisted images are recorded, by their return address.
+ * The unbounded routines are cut at the first NUL of either buffer.
+ */
+VOID
+cmp_rtn_handler(ADDRINT ret, ADDRINT a, ADDRINT b, ADDRINT n, BOOL bounded)
+{
+    image_t *im = wht_find_image(ret);
+    if (!im)
+        return;
+
+    UINT8 ba[CMP_BYTES], bb[CMP_BYTES];
+    size_t len = bounded && n < CMP_BYTES ? n : CMP_BYTES;
+    len = PIN_SafeCopy(ba, (VOID *)a, len);
+    len = PIN_SafeCopy(bb, (VOID *)b, len);
+    if (!bounded)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            if (!ba[i] || !bb[i])
+            {
+                len = i;
+                break;
+            }
+        }
+    }
+    if (!len || !memcmp(ba, bb, len))
+        return;
+
+    UINT64 site = ((UINT64)im->index << 32) | (UINT32)(ret - im->low);
+    cmp_entry_t *entry = &cmp_table[cmp_slot(site)];
+    entry->site = site;
+    entry->kind = CMP_RTN;
+    cmp_record(entry, ba, bb, (UINT32)len);
+}
+
+/*
+ * Instruments the CMP, TEST and SUB instructions of the block whose
+ * operands are registers, immediates or memory of 2 to 8 bytes.
+ */
+VOID
+cmp_instrument(BBL bbl, image_t *im)
+{
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+    {
+        UINT32 op = INS_Opcode(ins);
+        if (op != XED_ICLASS_CMP && op != XED_ICLASS_TEST &&
+                op != XED_ICLASS_SUB)
+            continue;
+        if (INS_OperandCount(ins) < 2)
+            continue;
+
+        // e.g. test eax, eax
+        if (INS_OperandIsReg(ins, 0) && INS_OperandIsReg(ins, 1) &&
+                INS_OperandReg(ins, 0) == INS_OperandReg(ins, 1))
+            continue;
+
+        UINT32 size = INS_OperandWidth(ins, 0) / 8;
+        if (size < 2 || size > sizeof(ADDRINT))
+            continue;
+
+        UINT32 flags = size;
+        BOOL valid = true;
+        IARGLIST args = IARGLIST_Alloc();
+        for (UINT32 i = 0; valid && i < 2; i++)
+        {
+            if (INS_OperandIsReg(ins, i))
+                IARGLIST_AddArguments(args, IARG_REG_VALUE,
+                        INS_OperandReg(ins, i), IARG_END);
+            else if (INS_OperandIsImmediate(ins, i))
+                IARGLIST_AddArguments(args, IARG_ADDRINT,
+                        (ADDRINT)INS_OperandImmediate(ins, i), IARG_END);
+            else if (INS_OperandIsMemory(ins, i))
+            {
+                IARGLIST_AddArguments(args, IARG_MEMORYREAD_EA, IARG_END);
+                flags |= CMP_MEM0 << i;
+            }
+            else
+                valid = false;
+        }
+
+        // the handler expects both operands in the list
+        if (valid)
+        {
+            UINT64 site = ((UINT64)im->index << 32) |
+                (UINT32)(INS_Address(ins) - im->low);
+            cmp_entry_t *entry = &cmp_table[cmp_slot(site)];
+            entry->site = site;
+            entry->kind = CMP_INS;
+            INS_InsertCall(
+                    ins,
+                    IPOINT_BEFORE,
+                    (AFUNPTR)cmp_handler,
+                    IARG_FAST_ANALYSIS_CALL,
+                    IARG_PTR,
+                    entry,
+                    IARG_UINT32,
+                    flags,
+                    IARG_IARGLIST,
+                    args,
+                    IARG_END
+                    );
+        }
+        IARGLIST_Free(args);
+    }
+}
+
+/*
+ * Hooks the comparison routines of the C library, in whatever image
+ * they are defined. The callers are checked against the whitelist.
+ */
+VOID
+cmp_hook(IMG img)
+{
+    static const struct
+    {
+        const char *name;
+        BOOL bounded;
+    } routines[] = {
+        { "memcmp", true },
+        { "bcmp", true },
+        { "strncmp", true },
+        { "strncasecmp", true },
+        { "strcmp", false },
+        { "strcasecmp", false },
+    };
+
+    if (!cmp_log_mode)
+        return;
+
+    for (size_t i = 0; i < sizeof(routines) / sizeof(routines[0]); i++)
+    {
+        RTN rtn = RTN_FindByName(img, routines[i].name);
+        if (!RTN_Valid(rtn))
+            continue;
+
+        RTN_Open(rtn);
+        RTN_InsertCall(
+                rtn,
+                IPOINT_BEFORE,
+                (AFUNPTR)cmp_rtn_handler,
+                IARG_RETURN_IP,
+                IARG_FUNCARG_ENTRYPOINT_VALUE,
+                0,
+                IARG_FUNCARG_ENTRYPOINT_VALUE,
+                1,
+                IARG_FUNCARG_ENTRYPOINT_VALUE,
+                2,
+                IARG_BOOL,
+                routines[i].bounded,
+                IARG_END
+                );
+        RTN_Close(rtn);
+    }
+}
+
+span_t **
+span_slot(spans_t *sp, UINT32 offset)
+{
+    UINT32 slot = (offset * 2654435761U) & sp->mask;
+    while (sp->slots[slot] && sp->slots[slot]->offset != offset)
+        slot = (slot + 1) & sp->mask;
+    return sp->slots + slot;
+}
+
+INT32
+span_resize(spans_t *sp, UINT32 size)
+{
+    span_t **old = sp->slots;
+    UINT32 old_size = old ? sp->mask + 1 : 0;
+
+    sp->slots = (span_t **)calloc(size, sizeof(span_t *));
+    if (sp->slots == NULL)
+    {
+        sp->slots = old;
+        return -1;
+    }
+    sp->mask = size - 1;
+    for (UINT32 i = 0; i < old_size; i++)
+    {
+        if (old[i])
+            *span_slot(sp, old[i]->offset) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/*
+ * Returns the span of a trace that is being instrumented, the one of
+ * its previous compilation if any. The older code may still run on
+ * another thread, so a span is never freed; at worst it asks for one
+ * more removal.
+ */
+span_t *
+span_get(image_t *im, TRACE trace)
+{
+    spans_t *sp = im->spans;
+    if (sp == NULL)
+    {
+        sp = (spans_t *)calloc(1, sizeof(spans_t));
+        if (sp == NULL || span_resize(sp, 1024))
+        {
+            free(sp);
+            return NULL;
+        }
+        im->spans = sp;
+    }
+
+    // at most 3/4 full
+    if ((sp->len + 1) * 4 > (sp->mask + 1) * 3 &&
+            span_resize(sp, (sp->mask + 1) * 2))
+        return NULL;
+
+    ADDRINT addr = TRACE_Address(trace);
+    UINT32 offset = (UINT32)(addr - im->low);
+    span_t **slot = span_slot(sp, offset);
+    if (*slot == NULL)
+    {
+        *slot = (span_t *)malloc(sizeof(span_t));
+        if (*slot == NULL)
+            return NULL;
+        (*slot)->offset = offset;
+        sp->len++;
+    }
+
+    // the image may be mapped elsewhere, or the trace may end
+    // somewhere else, since it was last compiled.
+    span_t *span = *slot;
+    span->low = addr;
+    span->high = addr + TRACE_Size(trace) - 1;
+    span->removed = 0;
+    return span;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL
+bbl_first_hit_handler(UINT8 *slot, span_t *span)
+{
+    *slot = 1;
+
+    // one request per instrumented trace is enough; it takes
+    // effect once the current trace is left.
+    if (!span->removed)
+    {
+        span->removed = 1;
+        PIN_RemoveInstrumentationInRange(span->low, span->high);
+    }
+}
+
+VOID PIN_FAST_ANALYSIS_CALL
+bbl_map_handler(UINT8 *slot)
+{
+    // the slot is resolved at instrumentation time as
+    // img->map + (ip - img->low). Every block has a byte of
+    // its own, so the plain store is idempotent and no locking
+    // is required for multithreaded targets. Bits sharing a
+    // byte would need an atomic OR, or hits would be lost.
+    *slot = 1;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL
+bbl_count_handler(UINT8 *slot)
+{
+    // saturates at 0xFF without a branch. Concurrent increments
+    // may be lost, which only matters for the bucket of the block.
+    *slot += (*slot != 0xFF);
+}
+
+/*
+ * Registers the trace in the trace table and returns its id, or -1 if
+ * the trace cannot be batched. Trace callbacks are serialized by Pin,
+ * thus no locking is needed.
+ */
+INT32
+trace_register(TRACE trace, image_t *img)
+{
+    // an entry of the table must fit in a single section
+    UINT32 count = TRACE_NumBbl(trace);
+    if (count == 0 || count > TRACE_MAX_BBLS ||
+            count * 5 + 2 * SEC_ROOM > flush_enc.size)
+        return -1;
+
+    if (trace_table.len == trace_table.size)
+    {
+        UINT32 size = trace_table.size ? trace_table.size * 2 : 0x1000;
+        trace_entry_t *list = (trace_entry_t *)realloc(
+                trace_table.list, size * sizeof(trace_entry_t));
+        if (list == NULL)
+            return -1;
+        trace_table.list = list;
+        trace_table.size = size;
+    }
+
+    UINT32 *offsets = (UINT32 *)malloc(count * sizeof(UINT32));
+    if (offsets == NULL)
+        return -1;
+
+    // every block must be kept, as the blocks that
+    // ran are counted from the head of the trace. The
+    // ones the per-block mode would not report are
+    // left for the decoders to skip.
+    UINT32 i = 0;
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        ADDRINT block = bbl_resolve(img, BBL_Address(bbl) - img->low);
+        if (block == NO_BLOCK || block == FILTERED_BLOCK)
+            block = TRACE_SKIP;
+        offsets[i++] = (UINT32)block;
+    }
+
+    trace_entry_t *entry = &trace_table.list[trace_table.len];
+    entry->image = img->index;
+    entry->count = count;
+    entry->offsets = offsets;
+    return (INT32)trace_table.len++;
+}
+
+/*
+ * Inserts the If/Then/record calls of the streaming mode on an
+ * instruction, so that they may be placed on a taken branch.
+ */
+VOID
+insert_record(INS ins, IPOINT ipoint, UINT64 image_index, UINT64 value)
+{
+    INS_InsertIfCall(
+            ins,
+            ipoint,
+            (AFUNPTR)bucket_is_full,
+            IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE,
+            bucket_reg,
+            IARG_END
+            );
+    INS_InsertThenCall(
+            ins,
+            ipoint,
+            (AFUNPTR)bucket_full_handler,
+            IARG_REG_VALUE,
+            bucket_reg,
+            IARG_END
+            );
+    INS_InsertCall(
+            ins,
+            ipoint,
+            (AFUNPTR)bbl_hit_handler,
+            IARG_FAST_ANALYSIS_CALL,
+            IARG_REG_VALUE,
+            bucket_reg,
+            IARG_UINT64,
+            image_index,
+            IARG_UINT64,
+            value,
+            IARG_END
+            );
+}
+
+/*
+ * One record per execution of the trace, instead of one per block.
+ * Blocks which do not end in a branch cannot leave the trace and are
+ * not instrumented at all.
+ */
+VOID
+trace_batch_instrument(TRACE trace, UINT32 id)
+{
+    UINT64 value = (UINT64)id << 16;
+    UINT32 i = 1;
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl), i++)
+    {
+        if (!BBL_Valid(BBL_Next(bbl)))
+        {
+            insert_record(BBL_InsHead(bbl), IPOINT_BEFORE, TRACE_INDEX, value | i);
+            break;
+        }
+
+        INS tail = BBL_InsTail(bbl);
+        if (INS_IsValidForIpointTakenBranch(tail))
+            insert_record(tail, IPOINT_TAKEN_BRANCH, TRACE_INDEX, value | i);
+    }
+}
+
+/*
+ * Returns the whitelist entry of the image of the trace, or NULL. The
+ * traces of a routine are resolved by the id of its image, for which
+ * the whitelist lookup has been done once at load, so the traces of
+ * the images that are not whitelisted cost no search at all.
+ */
+image_t *
+trace_image(TRACE trace)
+{
+    RTN rtn = TRACE_Rtn(trace);
+    if (RTN_Valid(rtn))
+    {
+        UINT32 id = IMG_Id(SEC_Img(RTN_Sec(rtn)));
+        if (id < img_ids_len && img_ids[id])
+            return img_ids[id] > 0 ? whitelist.list + img_ids[id] - 1 : NULL;
+    }
+    return wht_find_image(TRACE_Address(trace));
+}
+
+// set if any block of the trace is inside the filter of its image
+BOOL
+filter_trace(TRACE trace, image_t *im)
+{
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        if (bbl_resolve(im, BBL_Address(bbl) - im->low) != FILTERED_BLOCK)
+            return true;
+    }
+    return false;
+}
+
+VOID
+trace_instrument(TRACE trace)
+{
+    // get trace's address and check
+    // if the image it belongs to has
+    // been whitelisted.
+    ADDRINT addr = TRACE_Address(trace);
+
+    // every trace counts against the budget, whitelisted or not
+    if (bbl_limit)
+    {
+        TRACE_InsertIfCall(
+                trace,
+                IPOINT_BEFORE,
+                (AFUNPTR)bbl_budget_check,
+                IARG_FAST_ANALYSIS_CALL,
+                IARG_UINT32,
+                TRACE_NumBbl(trace),
+                IARG_END
+                );
+        TRACE_InsertThenCall(
+                trace,
+                IPOINT_BEFORE,
+                (AFUNPTR)bbl_budget_handler,
+                IARG_REG_VALUE,
+                bucket_reg,
+                IARG_END
+                );
+    }
+
+    image_t *im = trace_image(trace);
+    if (!im || (im->filter && !filter_trace(trace, im)))
+        return;
+    stats.instrumented++;
+
+    span_t *span = NULL;
+    if (first_hit_mode && im->map)
+    {
+        span = span_get(im, trace);
+        if (span == NULL)
+            return;
+    }
+
+    INT32 trace_id = -1;
+    if (trace_batch_mode && !im->map)
+    {
+        trace_id = trace_register(trace, im);
+        if (trace_id >= 0)
+            trace_batch_instrument(trace, (UINT32)trace_id);
+    }
+
+    // add instrumentation to all basic blocks
+    // in the current trace.
+    BBL bbl = TRACE_BblHead(trace);
+    for (; BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        addr = BBL_Address(bbl);
+        ADDRINT offset = bbl_resolve(im, addr - im->low);
+        if (offset == FILTERED_BLOCK)
+            continue;
+
+        if (edge_mode)
+        {
+            BBL_InsertCall(
+                    bbl,
+                    IPOINT_ANYWHERE,
+                    (AFUNPTR)edge_hit_handler,
+                    IARG_FAST_ANALYSIS_CALL,
+                    IARG_ADDRINT,
+                    edge_location(im, addr),
+                    IARG_REG_VALUE,
+                    prev_loc_reg,
+                    IARG_RETURN_REGS,
+                    prev_loc_reg,
+                    IARG_END
+                    );
+        }
+
+        if (stack_hash_mode)
+            shadow_instrument(bbl, im);
+        if (cmp_log_mode)
+            cmp_instrument(bbl, im);
+
+        // the IDA basic block is reported instead, blocks that
+        // are not part of any are of no interest.
+        if (offset == NO_BLOCK)
+            continue;
+
+        // the block has been hit before the trace was
+        // (re)compiled, there is no need to watch it.
+        if (span)
+        {
+            UINT8 *slot = im->map + offset;
+            if (*slot)
+                continue;
+
+            BBL_InsertCall(
+                    bbl,
+                    IPOINT_ANYWHERE,
+                    (AFUNPTR)bbl_first_hit_handler,
+                    IARG_FAST_ANALYSIS_CALL,
+                    IARG_PTR,
+                    slot,
+                    IARG_PTR,
+                    span,
+                    IARG_END
+                    );
+            continue;
+        }
+
+        // in dedup mode a single store into the
+        // image's map is enough.
+        if (dedup_mode && im->map)
+        {
+            BBL_InsertCall(
+                    bbl,
+                    IPOINT_ANYWHERE,
+                    hit_count_mode ? (AFUNPTR)bbl_count_handler
+                                   : (AFUNPTR)bbl_map_handler,
+                    IARG_FAST_ANALYSIS_CALL,
+                    IARG_PTR,
+                    im->map + offset,
+                    IARG_END
+                    );
+            continue;
+        }
+
+        // the whole trace is recorded at its exits
+        if (trace_id >= 0)
+            continue;
+
+        // enable tracing of this
+        // basic block.
+        BBL_InsertIfCall(
+                bbl,
+                IPOINT_ANYWHERE,
+                (AFUNPTR)bucket_is_full,
+                IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE,
+                bucket_reg,
+                IARG_END
+                );
+        BBL_InsertThenCall(
+                bbl,
+                IPOINT_ANYWHERE,
+                (AFUNPTR)bucket_full_handler,
+                IARG_REG_VALUE,
+                bucket_reg,
+                IARG_END
+                );
+        BBL_InsertCall(
+                bbl,
+                IPOINT_ANYWHERE,
+                (AFUNPTR)bbl_hit_handler,
+                IARG_FAST_ANALYSIS_CALL,
+                IARG_REG_VALUE,
+                bucket_reg,
+                IARG_UINT64,
+                (UINT64)im->index,
+                IARG_UINT64,
+                (UINT64)offset,
+                IARG_END
+                );
+    }
+}
+
+VOID
+trace_callback(TRACE trace, VOID *v)
+{
+    UINT64 start = clock_us();
+    trace_instrument(trace);
+    stats.jit_us += clock_us() - start;
+    stats.traces++;
+}
+
+/*
+ * FNV-1a of the call sites on top of the shadow stack. Without
+ * -stackhash the stack is empty and so is the hash.
+ */
+UINT32
+stack_hash(shadow_t *shadow)
+{
+    UINT32 h = 2166136261U;
+    UINT32 n = shadow->depth;
+    if (n > SHADOW_DEPTH)
+        n = SHADOW_DEPTH;
+    if (n > STACK_HASH_FRAMES)
+        n = STACK_HASH_FRAMES;
+
+    for (UINT32 i = 1; i <= n; i++)
+    {
+        UINT64 site = shadow->frames[(shadow->depth - i) & (SHADOW_DEPTH - 1)];
+        for (int j = 0; j < 8; j++, site >>= 8)
+            h = (h ^ (UINT8)site) * 16777619U;
+    }
+    return h;
+}
+
+/*
+ * Records the context of a fatal signal or exception in the bucket of
+ * the crashing thread, so that the driver can tell crashes apart
+ * without running the input again.
+ */
+VOID
+crash_capture(bucket_t *bkt, INT32 info, const CONTEXT *ctxt)
+{
+    crash_t *crash = &bkt->crash;
+    crash->signal = (UINT32)info;
+    crash->hash = stack_hash(&bkt->shadow);
+    crash->depth = bkt->shadow.depth;
+    crash->fault = bkt->fault_signal == info ? bkt->fault : 0;
+    crash->image = 0;
+    crash->offset = 0;
+    crash->name[0] = '\0';
+    if (ctxt == NULL)
+        return;
+
+    ADDRINT pc = PIN_GetContextReg(ctxt, REG_INST_PTR);
+    crash->offset = pc;
+
+    // the images may be (un)loaded by other threads
+    PIN_LockClient();
+    image_t *im = wht_find_image(pc);
+    if (im)
+    {
+        crash->image = im->index + 1;
+        crash->offset = pc - im->low;
+    }
+    else
+    {
+        IMG img = IMG_FindByAddress(pc);
+        if (IMG_Valid(img))
+        {
+            crash->offset = pc - IMG_LowAddress(img);
+            strncpy(crash->name, path_basename(IMG_Name(img).c_str()),
+                    sizeof(crash->name) - 1);
+            crash->name[sizeof(crash->name) - 1] = '\0';
+        }
+    }
+    PIN_UnlockClient();
+}
+
+#ifdef TARGET_LINUX
+/*
+ * The faulting address is only known to the signal interceptor; it
+ * is kept until the signal turns out to be fatal. The signal is
+ * always delivered to the application.
+ */
+BOOL
+fault_intercept(THREADID thridx, INT32 sig, CONTEXT *ctxt, BOOL has_handler,
+        const EXCEPTION_INFO *info, VOID *v)
+{
+    bucket_t *bkt = (bucket_t *)PIN_GetThreadData(bucket_key, thridx);
+    if (bkt == NULL)
+        bkt = bucket;
+
+    ADDRINT addr;
+    if (info != NULL && PIN_GetFaultyAccessAddress(info, &addr))
+    {
+        bkt->fault = addr;
+        bkt->fault_signal = sig;
+    }
+    return true;
+}
+#endif /* TARGET_LINUX */
+
+void
+context_change_cb(THREADID thridx, CONTEXT_CHANGE_REASON reason, const CONTEXT *from, CONTEXT *to, INT32 info, VOID *v) 
+{
+    bucket_t *bkt = (bucket_t *)PIN_GetThreadData(bucket_key, thridx);
+    if (bkt == NULL)
+        bkt = bucket;
+
+    switch(reason)
+    {
+        case CONTEXT_CHANGE_REASON_FATALSIGNAL:
+            crash_capture(bkt, info, from);
+            bucket_push(bkt, MARKER_INDEX, (UINT64)info);
+            break;
+        case CONTEXT_CHANGE_REASON_EXCEPTION:
+            #define IS_FATAL_EXCEPTION(ex) ((ex & 0xC0000000) == 0xC0000000)
+            if(IS_FATAL_EXCEPTION(info))
+            {
+                crash_capture(bkt, info, from);
+                bucket_push(bkt, MARKER_INDEX, (UINT64)info);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* Windows specific code */
+#ifdef TARGET_WINDOWS
+
+#define EVENT_WAIT_TIMEOUT 500
+/* Checks whether a time out event has been triggered. If that's the case
+ * it flushes the data from buckets into the pipe and returns.
+ */
+void 
+CheckTerminationEvent(void *arg)
+{
+    using namespace WIN32_API;
+    LOG("New thread has spawned.\n");
+    DWORD wait = timeout_ms ? watchdog_slice() : EVENT_WAIT_TIMEOUT;
+    while(IsProcessRunning)
+    {
+        if(budget_timed_out())
+        {
+            IsProcessRunning = false;
+            budget_expire(bucket);
+        }
+        else if(WaitForSingleObject(TimeoutEvent, wait) == WAIT_OBJECT_0)
+        {
+            LOG("Event was set.\n");
+
+            // SIGUSR2, process terminated due to a timeout event.
+            // The global bucket is only touched by the application
+            // threads at exit, the thread buckets are flushed then.
+            bucket_push(bucket, MARKER_INDEX, TIMEOUT_MARKER);
+
+            IsProcessRunning = false;
+            PIN_ExitApplication(0);
+        }
+    }
+}
+#endif /* TARGET_WINDOWS */
+
+/* IPC */
+
+/*
+ * Shared memory transport. The driver creates the region and the
+ * pintool appends the stream to it, exactly as it would write it to
+ * the FIFO, but without any system call. The region starts with a
+ * shm_header_t; `used' is updated after every write, so the region
+ * stays consistent even if the target dies.
+ */
+#define SHM_MAGIC 0x4d48535a
+#define SHM_OVERFLOW 0x1
+#define SHM_BUCKET_SIZE 0x100000
+
+typedef struct
+{
+    UINT32 magic;
+    UINT32 flags;
+    UINT64 size; // bytes available after the header
+    volatile UINT64 used;
+} shm_header_t;
+
+BOOL shm_mode;
+shm_header_t *shm;
+#ifdef TARGET_WINDOWS
+WIN32_API::HANDLE shmHandle;
+#endif /* TARGET_WINDOWS */
+
+int
+init_shm(const char *name)
+{
+#ifdef TARGET_LINUX
+    // this is what shm_open() does for names under /dev/shm,
+    // without pulling librt into the pintool.
+    int fd;
+    struct stat st;
+    if((fd = open(name, O_RDWR)) < 0) {
+        perror("open");
+        return 0;
+    }
+
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(shm_header_t)) {
+        close(fd);
+        return 0;
+    }
+
+    shm = (shm_header_t *)mmap(NULL, st.st_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(shm == MAP_FAILED) {
+        perror("mmap");
+        shm = NULL;
+        return 0;
+    }
+#elif TARGET_WINDOWS
+    {
+    using namespace WIN32_API;
+    shmHandle = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if(shmHandle == NULL) {
+        LOG("OpenFileMappingA failed.\n");
+        return 0;
+    }
+
+    shm = (shm_header_t *)MapViewOfFile(shmHandle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if(shm == NULL) {
+        LOG("MapViewOfFile failed.\n");
+        return 0;
+    }
+    }
+#else
+#error "This option is not supported yet."
+#endif
+
+    if(shm->magic != SHM_MAGIC) {
+        LOG("Shared memory region is not initialized.\n");
+        return 0;
+    }
+    return SHM_BUCKET_SIZE;
+}
+
+VOID
+shm_write(VOID *buffer, size_t count)
+{
+    UINT64 used = shm->used;
+    if(used + count > shm->size)
+    {
+        // the rest of the trace is dropped, the driver sees the
+        // flag and neither evaluates nor keeps the input
+        shm->flags |= SHM_OVERFLOW;
+        return;
+    }
+    memcpy((UINT8 *)(shm + 1) + used, buffer, count);
+    shm->used = used + count;
+}
+
+VOID
+close_shm()
+{
+#ifdef TARGET_LINUX
+    munmap(shm, sizeof(shm_header_t) + shm->size);
+#elif TARGET_WINDOWS
+    WIN32_API::UnmapViewOfFile(shm);
+    WIN32_API::CloseHandle(shmHandle);
+#endif
+    shm = NULL;
+}
+
+// writes to the output, the time it takes is blocked_us
+VOID
+write_to_pipe(VOID *buffer, size_t count)
+{
+    if(shm_mode)
+    {
+        pipe_write(buffer, count);
+        return;
+    }
+
+    UINT64 start = clock_us();
+    pipe_write(buffer, count);
+    stats.blocked_us += clock_us() - start;
+}
+
+VOID
+pipe_write(VOID *buffer, size_t count)
+{
+    // the fork server and the persistent mode between two runs have
+    // no output; fd 0 or a NULL region would be written otherwise
+    if(output_closed)
+    {
+        LOG("[!] write with no output open\n");
+        PIN_ExitProcess(1);
+    }
+
+    if(shm_mode)
+    {
+        stats.writes++;
+        stats.bytes += count;
+        shm_write(buffer, count);
+        return;
+    }
+
+    stats.writes++;
+    stats.bytes += count;
+#ifdef TARGET_LINUX
+    ssize_t bytes_written = 0;
+    while(count > 0)
+    {
+        bytes_written = write(pipeHandle, buffer, count);
+        if(bytes_written < 0)
+        {
+            perror("write");
+            exit(1);
+        }
+        else
+        {
+            count -= bytes_written;
+        }
+    }
+#elif TARGET_WINDOWS
+    {
+        using namespace WIN32_API;
+        DWORD NumberOfBytesWritten;
+        NumberOfBytesWritten = 0;
+        WriteFile(pipeHandle, buffer, count, &NumberOfBytesWritten, NULL);
+        if(NumberOfBytesWritten != count)
+        {
+            LOG("WriteFile failed ?\n");
+        }
+    }
+#else
+#error "This operating system is not supported."
+#endif
+}
+
+#ifdef TARGET_LINUX
+int
+get_pipe_max_size()
+{
+    FILE *fp;
+    int pipe_max_size = 0;
+
+    fp = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if(fp == NULL)
+        return 0;
+
+    if(fscanf(fp, "%u", &pipe_max_size) != 1)
+    {
+        pipe_max_size = 0;
+        
+        fprintf(stderr, "Unable to read /proc/sys/fs/pipe-max-size properly\n");
+    }
+
+    return pipe_max_size;
+}
+#endif /* TARGET_LINUX */
+
+char *fix_pipe_name(const char *name)
+{
+    char *p;
+    if(name[0] == '\\' && name[1] == '\\') {
+        p = (char *)name;
+    } else {
+        p = (char *)malloc(strlen(name) + 0x20);
+        sprintf(p, "\\\\.\\pipe\\%s", name);
+    }
+    return p;
+}
+
+int
+init_fifo(const char *fifoname)
+{
+#ifdef TARGET_LINUX
+    int pipe_max_size;
+    pipe_max_size = get_pipe_max_size();
+    LOG("init_fifo");
+    if(!pipe_max_size)
+        return 0;
+
+    LOG("opening handle");
+    if((pipeHandle = open(fifoname, O_WRONLY)) < 0) {
+        perror("open");
+        return 0;
+    }
+
+    if(fcntl(pipeHandle, F_SETPIPE_SZ, pipe_max_size) < 0) {
+        perror("fcntl");
+        return 0;
+    }
+
+    return pipe_max_size;
+#elif TARGET_WINDOWS
+    {   
+    using namespace WIN32_API;
+    #define WINDOWS_PIPE_SIZE 0x8000
+    char *pipename = fix_pipe_name(fifoname);
+    LOG(pipename);
+    pipeHandle = CreateNamedPipe(pipename,
+        PIPE_ACCESS_OUTBOUND,
+        PIPE_TYPE_BYTE | PIPE_WAIT,
+        1,
+        WINDOWS_PIPE_SIZE,
+        WINDOWS_PIPE_SIZE,
+        0,
+        NULL);
+
+    if(pipeHandle == INVALID_HANDLE_VALUE) {
+        LOG("CreateNamedPipeA failed.\n");
+        return 0;
+    }
+
+    if(!ConnectNamedPipe(pipeHandle, NULL)) {
+        if(GetLastError() != ERROR_PIPE_CONNECTED) {
+            LOG("ConnectNamedPipe failed.\n");
+            return 0;
+        }
+    }
+    return WINDOWS_PIPE_SIZE;
+    }
+#else
+#error "This option is not supported yet."
+#endif
+}
+
+/*
+ * Opens the output of the trace; either a FIFO or, if -shm
+ * is set, a shared memory region.
+ */
+int
+init_output(const char *name)
+{
+    int size = shm_mode ? init_shm(name) : init_fifo(name);
+    output_closed = !size;
+    return size;
+}
+
+VOID
+close_output()
+{
+    output_closed = true;
+    if(shm_mode)
+    {
+        close_shm();
+        return;
+    }
+#ifdef TARGET_LINUX
+    LOG("closing fifo");
+    close(pipeHandle);
+#elif TARGET_WINDOWS
+    WIN32_API::CloseHandle(pipeHandle);
+#endif
+}
+
+void
+write_header()
+{
+    uint16_t image_count;
+    uint8_t *header;
+    unsigned int header_size, pos;
+
+    image_count = (uint16_t)whitelist.len;
+    header_size = 10;
+    header = NULL;
+
+    for(uint16_t i = 0; i < image_count; i++)
+        header_size += strlen(whitelist.list[i].path) + 2;
+
+    header = (uint8_t*)malloc(header_size);
+    *(uint32_t *)header = TRACE_MAGIC;
+    *(uint16_t *)(header + 4) = TRACE_VERSION;
+    *(uint16_t *)(header + 6) = ida_mode ? TRACE_FLAG_IDA : 0;
+    *(uint16_t *)(header + 8) = image_count;
+    pos = 10;
+
+    for(uint16_t i = 0; i < image_count; i++)
+    {
+        *(uint16_t *)(header + pos) = (uint16_t)strlen(whitelist.list[i].path);
+        pos += 2;
+        memcpy(header + pos, whitelist.list[i].path, strlen(whitelist.list[i].path));
+        pos += strlen(whitelist.list[i].path);
+    }
+
+    //[magic - 4 bytes][version - 2 bytes][flags - 2 bytes]
+    //[number of images - 2 bytes]([name length - 2 bytes][imagename - no-null byte])...
+    write_to_pipe(header, header_size);
+    free(header);
+}
+
+/* Fork server and persistent mode */
+#ifdef TARGET_LINUX
+
+/*
+ * The fork server stops the target at the entry of a routine and
+ * forks a fresh child for every test case. The children inherit the
+ * code cache and the coverage collected so far, thus Pin startup,
+ * the JIT warm-up and the image whitelisting are paid only once.
+ *
+ * The persistent mode goes one step further and does not fork at
+ * all. The registers are saved at the entry of the routine and, when
+ * the routine returns, the coverage is flushed and reset and the
+ * routine is executed again with PIN_ExecuteAt(). The target must
+ * read the input file from within the routine and must not leak
+ * state between iterations.
+ *
+ * Both modes speak the same protocol over the control FIFOs
+ * (<ctl>.cmd and <ctl>.st):
+ *   server -> driver: [FORKSRV_HELLO, 4 bytes]
+ *   driver -> server: [path length, 4 bytes][output FIFO path]
+ *   server -> driver: [pid of the process running the test, 4 bytes]
+ *   server -> driver: [wait status of the test, 4 bytes]
+ * The last three steps are repeated for every test case. The trace of
+ * each test case is written to its own output FIFO as usual.
+ */
+#define FORKSRV_HELLO 0x4e5a4843
+
+BOOL forksrv_mode;
+BOOL forksrv_child;
+std::string forksrv_entry;
+std::string forksrv_ctl;
+AFUNPTR app_fork;
+int ctl_cmd = -1;
+int ctl_status = -1;
+
+BOOL persist_mode;
+BOOL persist_started;
+BOOL persist_running; // an iteration is in progress
+UINT32 persist_depth; // recursive calls of the routine
+UINT32 persist_iters;
+UINT32 persist_max_iters;
+CONTEXT persist_ctx;
+
+// the coverage gathered before the first iteration, which is
+// put back in the maps before each iteration.
+typedef struct
+{
+    UINT8 *slot;
+    UINT8 value;
+} persist_slot_t;
+
+persist_slot_t *persist_startup;
+size_t persist_startup_len;
+
+INT32
+forksrv_read(VOID *buffer, size_t count)
+{
+    ssize_t bytes_read;
+    while(count > 0)
+    {
+        bytes_read = read(ctl_cmd, buffer, count);
+        if(bytes_read <= 0)
+            return -1;
+        buffer = (UINT8 *)buffer + bytes_read;
+        count -= bytes_read;
+    }
+    return 0;
+}
+
+VOID
+forksrv_write(UINT32 value)
+{
+    if(write(ctl_status, &value, sizeof(value)) != sizeof(value))
+    {
+        perror("write");
+        PIN_ExitProcess(1);
+    }
+}
+
+VOID
+forksrv_open()
+{
+    std::string cmd = forksrv_ctl + ".cmd";
+    std::string status = forksrv_ctl + ".st";
+    if((ctl_cmd = open(cmd.c_str(), O_RDONLY)) < 0 ||
+            (ctl_status = open(status.c_str(), O_WRONLY)) < 0)
+    {
+        perror("open");
+        PIN_ExitProcess(1);
+    }
+    forksrv_write(FORKSRV_HELLO);
+    LOG("fork server is ready\n");
+}
+
+/*
+ * Reads the path of the next output FIFO. If the driver has
+ * gone away, the process exits.
+ */
+VOID
+forksrv_next(char *path, size_t size)
+{
+    UINT32 len;
+    if(forksrv_read(&len, sizeof(len)) || len >= size ||
+            forksrv_read(path, len))
+    {
+        LOG("fork server exiting\n");
+        PIN_ExitProcess(0);
+    }
+    path[len] = '\0';
+}
+
+/*
+ * The children do not inherit the watchdog thread, so the server
+ * itself enforces -timeout, on the wall clock, by sending SIGUSR2
+ * like the driver would.
+ */
+int
+forksrv_wait(int pid, int *wstatus)
+{
+    if(!timeout_ms)
+        return waitpid(pid, wstatus, 0);
+
+    UINT64 deadline = clock_ms(false) + timeout_ms;
+    while(true)
+    {
+        int ret = waitpid(pid, wstatus, WNOHANG);
+        if(ret != 0)
+            return ret;
+        if(clock_ms(false) >= deadline)
+        {
+            kill(pid, SIGUSR2);
+            return waitpid(pid, wstatus, 0);
+        }
+        usleep(1000);
+    }
+}
+
+/*
+ * Runs once, when the target reaches the entry routine. In the
+ * server it never returns; in every child it returns and the target
+ * carries on from the entry of the routine.
+ */
+VOID
+forksrv_loop(CONTEXT *ctxt, THREADID tid)
+{
+    static BOOL started = false;
+    if(started || !app_fork)
+        return;
+    started = true;
+
+    forksrv_open();
+    while(true)
+    {
+        char path[PATH_MAX];
+        forksrv_next(path, sizeof(path));
+
+        // fork through the application, so that Pin follows
+        // the child and keeps its code cache.
+        int pid = -1;
+        PIN_CallApplicationFunction(
+                ctxt,
+                tid,
+                CALLINGSTD_DEFAULT,
+                app_fork,
+                NULL,
+                PIN_PARG(int), &pid,
+                PIN_PARG_END()
+                );
+
+        if(pid == 0)
+        {
+            // the instrumentation and the comparisons of the
+            // server are not the child's. Only the entries that
+            // are in use are written, the table is large.
+            memset(&stats, 0, sizeof(stats));
+            for (UINT32 i = 0; cmp_log_mode && i < CMP_TABLE_SIZE; i++)
+                if (cmp_table[i].count)
+                    cmp_table[i].count = 0;
+            forksrv_child = true;
+            close(ctl_cmd);
+            close(ctl_status);
+            if(!init_output(path))
+            {
+                LOG("init_output() failed in child\n");
+                PIN_ExitProcess(1);
+            }
+            write_header();
+            budget_arm();
+            return;
+        }
+
+        int wstatus = 0;
+        forksrv_write((UINT32)pid);
+        if(pid < 0 || forksrv_wait(pid, &wstatus) < 0)
+            wstatus = -1;
+        forksrv_write((UINT32)wstatus);
+    }
+}
+
+/*
+ * Counts the non-empty slots of the dedup and edge maps and
+ * stores them in out, unless it is NULL.
+ */
+size_t
+persist_walk(persist_slot_t *out)
+{
+    size_t count = 0;
+    for (off_t i=0; i < whitelist.len; i++)
+    {
+        image_t *img = whitelist.list + i;
+        if (!img->map)
+            continue;
+
+        ADDRINT size = MAP_SIZE(img);
+        for (ADDRINT j=0; j < size; j++)
+        {
+            // skip empty regions a word at a time
+            if (!(j & 7) && j + 8 <= size && !*(UINT64 *)(img->map + j))
+            {
+                j += 7;
+                continue;
+            }
+            if (!img->map[j])
+                continue;
+            if (out)
+            {
+                out[count].slot = img->map + j;
+                out[count].value = img->map[j];
+            }
+            count++;
+        }
+    }
+
+    for (size_t i=0; edge_mode && i < EDGE_MAP_SIZE; i++)
+    {
+        if (!edge_map[i])
+            continue;
+        if (out)
+        {
+            out[count].slot = edge_map + i;
+            out[count].value = edge_map[i];
+        }
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Keeps the startup coverage, so that every iteration reports
+ * it, as every child of the fork server does.
+ */
+VOID
+persist_save()
+{
+    size_t count = persist_walk(NULL);
+    if (!count)
+        return;
+
+    persist_startup = (persist_slot_t *)malloc(count * sizeof(persist_slot_t));
+    if (persist_startup == NULL)
+    {
+        LOG("[!] Could not keep the startup coverage\n");
+        return;
+    }
+    persist_startup_len = persist_walk(persist_startup);
+}
+
+VOID
+persist_restore()
+{
+    for (size_t i=0; i < persist_startup_len; i++)
+        *persist_startup[i].slot = persist_startup[i].value;
+}
+
+/*
+ * Starts an iteration. The returned value is the new value of
+ * prev_loc_reg in edge mode, which would otherwise carry the
+ * last block of the previous iteration into this one.
+ */
+ADDRINT
+persist_enter(CONTEXT *ctxt, ADDRINT prev_loc)
+{
+    if(persist_running)
+    {
+        persist_depth++;
+        return prev_loc;
+    }
+
+    if(!persist_started)
+    {
+        persist_started = true;
+        PIN_SaveContext(ctxt, &persist_ctx);
+        persist_save();
+        forksrv_open();
+    }
+    else
+        persist_restore();
+
+    char path[PATH_MAX];
+    forksrv_next(path, sizeof(path));
+    if(!init_output(path))
+    {
+        LOG("init_output() failed\n");
+        PIN_ExitProcess(1);
+    }
+    write_header();
+    forksrv_write((UINT32)getpid());
+    persist_running = true;
+    budget_arm();
+    return 0;
+}
+
+VOID
+persist_leave(CONTEXT *ctxt)
+{
+    if(!persist_running)
+        return;
+
+    if(persist_depth)
+    {
+        persist_depth--;
+        return;
+    }
+
+    // report this iteration and start over with a clean state
+    budget_disarm();
+    trace_flush();
+    close_output();
+    persist_running = false;
+    forksrv_write(0);
+
+    if(++persist_iters < persist_max_iters)
+        PIN_ExecuteAt(&persist_ctx);
+
+    // let the target return and exit normally, the
+    // driver will start a new instance.
+    LOG("persistent mode reached the iteration limit\n");
+}
+
+VOID
+forksrv_hook(IMG img)
+{
+    if(!forksrv_mode && !persist_mode)
+        return;
+
+    RTN rtn = RTN_FindByName(img, "fork");
+    if(RTN_Valid(rtn) && !app_fork)
+        app_fork = (AFUNPTR)RTN_Address(rtn);
+
+    rtn = RTN_FindByName(img, forksrv_entry.c_str());
+    if(!RTN_Valid(rtn))
+        return;
+
+    LOG("[+] Fork server entry found\n");
+    RTN_Open(rtn);
+    if(forksrv_mode)
+    {
+        RTN_InsertCall(
+                rtn,
+                IPOINT_BEFORE,
+                (AFUNPTR)forksrv_loop,
+                IARG_CONTEXT,
+                IARG_THREAD_ID,
+                IARG_END
+                );
+    }
+    else
+    {
+        if (edge_mode)
+            RTN_InsertCall(
+                    rtn,
+                    IPOINT_BEFORE,
+                    (AFUNPTR)persist_enter,
+                    IARG_CONTEXT,
+                    IARG_REG_VALUE,
+                    prev_loc_reg,
+                    IARG_RETURN_REGS,
+                    prev_loc_reg,
+                    IARG_END
+                    );
+        else
+            RTN_InsertCall(
+                    rtn,
+                    IPOINT_BEFORE,
+                    (AFUNPTR)persist_enter,
+                    IARG_CONTEXT,
+                    IARG_ADDRINT,
+                    0,
+                    IARG_END
+                    );
+        RTN_InsertCall(
+                rtn,
+                IPOINT_AFTER,
+                (AFUNPTR)persist_leave,
+                IARG_CONTEXT,
+                IARG_END
+                );
+    }
+    RTN_Close(rtn);
+}
+
+#else
+
+BOOL forksrv_mode;
+BOOL forksrv_child;
+BOOL persist_mode;
+BOOL persist_running;
+
+VOID
+forksrv_hook(IMG img)
+{
+}
+
+#endif /* TARGET_LINUX */
+
+/*
+ * Main and usage
+ */
+KNOB<std::string> 
+knob_database(
+        KNOB_MODE_WRITEONCE, 
+        "pintool",
+        "o", "", 
+        "specify an output file that will be generated from the target executable"
+        );
+
+KNOB<BOOL>
+knob_shm(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "shm", "0",
+        "the output is a shared memory region created by the driver instead of a FIFO"
+        );
+
+KNOB<std::string>
+knob_event(
+    KNOB_MODE_WRITEONCE,
+    "pintool",
+    "e", "",
+    "windows only - the name of event");
+
+KNOB<BOOL>
+knob_dedup(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "dedup", "0",
+        "record every basic block once and write only the unique offsets at exit"
+        );
+
+KNOB<BOOL>
+knob_edges(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "edges", "0",
+        "additionally record hashed (previous block, current block) edges"
+        );
+
+KNOB<BOOL>
+knob_stack_hash(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "stackhash", "0",
+        "keep a shadow call stack, to hash the call stack of a crash"
+        );
+
+KNOB<BOOL>
+knob_cmp_log(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "cmplog", "0",
+        "record the operands of the comparisons and of the memcmp() family"
+        );
+
+KNOB<BOOL>
+knob_hit_counts(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "hitcounts", "0",
+        "implies -dedup; count the hits of every block and write their buckets at exit"
+        );
+
+KNOB<BOOL>
+knob_first_hit(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "firsthit", "0",
+        "implies -dedup; remove the instrumentation of each block after its first hit"
+        );
+
+KNOB<BOOL>
+knob_trace_batch(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "tracebatch",
+        "0",
+        "write a single record per executed trace");
+
+KNOB<UINT32>
+knob_timeout(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "timeout",
+        "0",
+        "end a run after that many milliseconds, 0 for no limit");
+
+KNOB<BOOL>
+knob_cputime(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "cputime",
+        "0",
+        "measure -timeout in CPU time instead of wall clock time");
+
+KNOB<UINT64>
+knob_bblimit(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "bblimit",
+        "0",
+        "end a run after about that many basic blocks, 0 for no limit");
+
+KNOB<std::string>
+knob_forksrv(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "forksrv", "",
+        "linux only - run as a fork server stopped at the entry of this routine"
+        );
+
+KNOB<std::string>
+knob_persist(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "persist", "",
+        "linux only - execute this routine in a loop, once for every test case"
+        );
+
+KNOB<UINT32>
+knob_iters(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "iters", "1000",
+        "linux only - the number of iterations before the persistent mode exits"
+        );
+
+KNOB<std::string>
+knob_ctl(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "ctl", "",
+        "linux only - the prefix of the fork server/persistent mode control FIFOs"
+        );
+
+KNOB<std::string>
+knob_idmp(
+        KNOB_MODE_APPEND,
+        "pintool",
+        "idmp", "",
+        "IDA dump of a whitelisted image, to report IDA basic blocks");
+
+KNOB<std::string>
+knob_range(
+        KNOB_MODE_APPEND,
+        "pintool",
+        "range", "",
+        "image:start-end, instrument only these offsets (hex) of a whitelisted image");
+
+KNOB<std::string>
+knob_function(
+        KNOB_MODE_APPEND,
+        "pintool",
+        "fn", "",
+        "image:function, instrument only these functions of a whitelisted image");
+
+KNOB<std::string>
+knob_tcache(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "tcache", "",
+        "directory of the trace cache, which keeps how the blocks resolve across runs");
+
+KNOB<UINT32>
+knob_async(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "async", "0",
+        "spare output buffers of the writer thread, 0 writes from the application threads");
+
+KNOB<UINT32>
+knob_bufsize(
+        KNOB_MODE_WRITEONCE,
+        "pintool",
+        "bufsize", "1048576",
+        "bytes of every output buffer of the writer thread");
+
+KNOB<std::string> 
+knob_whitelist(
+        KNOB_MODE_APPEND, 
+        "pintool",
+        "wht", "",
+        "list of image names to instrument"
+        );
+
+/*
+ * Hit counts are bucketed into powers of two, so that small
+ * changes in loop iterations do not count as new coverage.
+ */
+UINT8
+hit_bucket(UINT8 count)
+{
+    if (count <= 3)
+        return count == 3 ? 4 : count;
+    if (count <= 7)
+        return 8;
+    if (count <= 15)
+        return 16;
+    if (count <= 31)
+        return 32;
+    if (count <= 127)
+        return 64;
+    return 128;
+}
+
+/*
+ * Walks the map of every whitelisted image and writes a SEC_BLOCKS
+ * section with the sorted offsets of the blocks that were hit at
+ * least once, or a SEC_COUNTS section that also has their hit count
+ * buckets. A section that fills up is continued in a new one.
  */
-void 
-CheckTerminationEvent(void *arg)
+VOID
+dedup_flush()
 {
-    using namespace WIN32_API;
-    LOG("New thread has spawned.\n");
-    while(IsProcessRunning)
+    encoder_t *enc = &flush_enc;
+    UINT8 type = hit_count_mode ? SEC_COUNTS : SEC_BLOCKS;
+    for (off_t i=0; i < whitelist.len; i++)
     {
-        if(WaitForSingleObject(TimeoutEvent, EVENT_WAIT_TIMEOUT) == WAIT_OBJECT_0)
-        {
-            LOG("Event was set.\n");
-            PIN_GetLock(PinThreadLock, 0);
+        image_t *img = whitelist.list + i;
+        if (!img->map)
+            continue;
 
-            if(IS_BUCKET_FULL(bucket))
+        ADDRINT size = MAP_SIZE(img);
+        ADDRINT j = 0, prev = 0;
+        enc_begin(enc, type);
+        enc_varint(enc, img->index);
+        while (j < size)
+        {
+            // skip empty regions a word at a time
+            if (!(j & 7) && j + 8 <= size && !*(UINT64 *)(img->map + j))
             {
-                write_to_pipe(bucket->start, (bucket->end - bucket->start) * sizeof(node_t));
-                bucket->curr = bucket->start;
+                j += 8;
+                continue;
             }
-            bucket->curr->image_index = 0xFFFFFFFFFFFFFFFF;
-            // SIGUSR2, process terminated due to a timeout event
-            bucket->curr->bbl = (uint64_t)(0x0000000c);
-            bucket->curr++;
 
-            IsProcessSignaled = true;
-            IsProcessRunning = false;
-            PIN_ReleaseLock(PinThreadLock);
-            PIN_ExitApplication(0);
+            if (img->map[j])
+            {
+                enc_varint(enc, j - prev);
+                if (hit_count_mode)
+                    enc_varint(enc, hit_bucket(img->map[j]));
+                prev = j;
+
+                // consume the entry, so that the next
+                // persistent iteration starts clean.
+                img->map[j] = 0;
+                bbls_count++;
+
+                if (enc_full(enc))
+                {
+                    enc_end(enc);
+                    enc_flush(enc);
+                    enc_begin(enc, type);
+                    enc_varint(enc, img->index);
+                    prev = 0;
+                }
+            }
+            j++;
         }
+        enc_end(enc);
     }
+    enc_flush(enc);
 }
 
-/* Signal the interal pin thread that the process is exiting
- * wait the thread to terminate.
+/*
+ * Writes a SEC_EDGES section with every edge that was hit: the
+ * delta encoded index of the edge inside the map and its bucket.
+ * Every value of a section payload is a varint, unless noted.
  */
 VOID
-TerminateInternalPINThreads(VOID *dummy)
+edge_flush()
 {
-    LOG("Waiting for CheckTerminiationEvent\n");
-    IsProcessRunning = false;
-    PIN_WaitForThreadTermination(InternalPINThreadUid, PIN_INFINITE_TIMEOUT, NULL);
-    LOG("CheckTerminatioEvent has finished.\n");
-}
-#endif /* TARGET_WINDOWS */
+    encoder_t *enc = &flush_enc;
+    UINT64 prev = 0;
 
-/* IPC */
-VOID
-write_to_pipe(VOID *buffer, size_t count)
-{
-#ifdef TARGET_LINUX
-    ssize_t bytes_written = 0;
-    while(count > 0)
-    {
-        bytes_written = write(pipeHandle, buffer, count);
-        if(bytes_written < 0)
-        {
-            perror("write");
-            exit(1);
-        }
-        else
-        {
-            count -= bytes_written;
-        }
-    }
-#elif TARGET_WINDOWS
+    enc_begin(enc, SEC_EDGES);
+    for (UINT64 i=0; i < EDGE_MAP_SIZE; i++)
     {
-        using namespace WIN32_API;
-        DWORD NumberOfBytesWritten;
-        NumberOfBytesWritten = 0;
-        WriteFile(pipeHandle, buffer, count, &NumberOfBytesWritten, NULL);
-        if(NumberOfBytesWritten != count)
+        if (!edge_map[i])
+            continue;
+
+        enc_varint(enc, i - prev);
+        enc_varint(enc, hit_bucket(edge_map[i]));
+        prev = i;
+        edge_map[i] = 0;
+
+        if (enc_full(enc))
         {
-            LOG("WriteFile failed ?\n");
+            enc_end(enc);
+            enc_flush(enc);
+            enc_begin(enc, SEC_EDGES);
+            prev = 0;
         }
     }
-#else
-#error "This operating system is not supported."
-#endif
+    enc_end(enc);
+    enc_flush(enc);
 }
 
-#ifdef TARGET_LINUX
-int
-get_pipe_max_size()
+/*
+ * Writes a SEC_CMPS section with the operand pairs of every site of
+ * the comparison table: the site, the kind of the comparison and its
+ * pairs, the length of a pair followed by the bytes of both operands.
+ */
+VOID
+cmp_flush()
 {
-    FILE *fp;
-    int pipe_max_size = 0;
-
-    fp = fopen("/proc/sys/fs/pipe-max-size", "r");
-    if(fp == NULL)
-        return 0;
+    encoder_t *enc = &flush_enc;
 
-    if(fscanf(fp, "%u", &pipe_max_size) != 1)
+    enc_begin(enc, SEC_CMPS);
+    for (UINT32 i = 0; i < CMP_TABLE_SIZE; i++)
     {
-        pipe_max_size = 0;
-        
-        fprintf(stderr, "Unable to read /proc/sys/fs/pipe-max-size properly\n");
-    }
+        cmp_entry_t *entry = &cmp_table[i];
+        if (!entry->count)
+            continue;
 
-    return pipe_max_size;
-}
-#endif /* TARGET_LINUX */
+        // an entry must not be split between sections
+        if (enc->len + SEC_ROOM + CMP_PAIRS * (1 + 2 * CMP_BYTES) > enc->size)
+        {
+            enc_end(enc);
+            enc_flush(enc);
+            enc_begin(enc, SEC_CMPS);
+        }
 
-char *fix_pipe_name(const char *name)
-{
-    char *p;
-    if(name[0] == '\\' && name[1] == '\\') {
-        p = (char *)name;
-    } else {
-        p = (char *)malloc(strlen(name) + 0x20);
-        sprintf(p, "\\\\.\\pipe\\%s", name);
+        UINT32 pairs = entry->count < CMP_PAIRS ? entry->count : CMP_PAIRS;
+        enc_varint(enc, entry->site);
+        enc_varint(enc, entry->kind);
+        enc_varint(enc, pairs);
+        for (UINT32 j = 0; j < pairs; j++)
+        {
+            UINT32 len = entry->len[j];
+            enc_varint(enc, len);
+            memcpy(enc->buf + enc->len, entry->ops[j][0], len);
+            memcpy(enc->buf + enc->len + len, entry->ops[j][1], len);
+            enc->len += 2 * len;
+        }
+        entry->count = 0;
     }
-    return p;
+    enc_end(enc);
+    enc_flush(enc);
 }
 
-int
-init_fifo(const char *fifoname)
+/*
+ * Writes the trace table in SEC_TRACE_TABLE sections. Every section
+ * starts with the id of its first entry; an entry is the image, the
+ * number of blocks and the zigzag encoded deltas of their offsets.
+ */
+VOID
+trace_table_write()
 {
-#ifdef TARGET_LINUX
-    int pipe_max_size;
-    pipe_max_size = get_pipe_max_size();
-    LOG("init_fifo");
-    if(!pipe_max_size)
-        return 0;
-
-    LOG("opening handle");
-    if((pipeHandle = open(fifoname, O_WRONLY)) < 0) {
-        perror("open");
-        return 0;
-    }
-
-    if(fcntl(pipeHandle, F_SETPIPE_SZ, pipe_max_size) < 0) {
-        perror("fcntl");
-        return 0;
-    }
+    encoder_t *enc = &flush_enc;
 
-    return pipe_max_size;
-#elif TARGET_WINDOWS
-    {   
-    using namespace WIN32_API;
-    #define WINDOWS_PIPE_SIZE 0x8000
-    char *pipename = fix_pipe_name(fifoname);
-    LOG(pipename);
-    pipeHandle = CreateNamedPipe(pipename,
-        PIPE_ACCESS_OUTBOUND,
-        PIPE_TYPE_BYTE | PIPE_WAIT,
-        1,
-        WINDOWS_PIPE_SIZE,
-        WINDOWS_PIPE_SIZE,
-        0,
-        NULL);
+    enc_begin(enc, SEC_TRACE_TABLE);
+    enc_varint(enc, 0);
+    for (UINT32 i = 0; i < trace_table.len; i++)
+    {
+        trace_entry_t *entry = &trace_table.list[i];
 
-    if(pipeHandle == INVALID_HANDLE_VALUE) {
-        LOG("CreateNamedPipeA failed.\n");
-        return 0;
-    }
+        // an entry must not be split between sections
+        if (enc->len + SEC_ROOM + entry->count * 5 > enc->size)
+        {
+            enc_end(enc);
+            enc_flush(enc);
+            enc_begin(enc, SEC_TRACE_TABLE);
+            enc_varint(enc, i);
+        }
 
-    if(!ConnectNamedPipe(pipeHandle, NULL)) {
-        if(GetLastError() != ERROR_PIPE_CONNECTED) {
-            LOG("ConnectNamedPipe failed.\n");
-            return 0;
+        enc_varint(enc, entry->image);
+        enc_varint(enc, entry->count);
+        UINT64 prev = 0;
+        for (UINT32 j = 0; j < entry->count; j++)
+        {
+            enc_varint(enc, ZIGZAG((UINT64)entry->offsets[j] - prev));
+            prev = entry->offsets[j];
         }
     }
-    return WINDOWS_PIPE_SIZE;
-    }
-#else
-#error "This option is not supported yet."
-#endif
+    enc_end(enc);
+    enc_flush(enc);
 }
 
-void
-write_header()
+/*
+ * Writes the SEC_STATS trailer of the trace and starts the counters
+ * of the next one over.
+ */
+VOID
+stats_flush()
 {
-    uint8_t image_count;
-    uint8_t *header;
-    unsigned int header_size, pos;
-
-    image_count = (uint8_t)whitelist.len;
-    header_size = 1;
-    header = NULL;
-
-    for(uint8_t i = 0; i < image_count; i++)
-        header_size += strlen(whitelist.list[i].path) + 2;
-
-    header = (uint8_t*)malloc(header_size);
-    *header = image_count;
-    pos = 1; 
+    encoder_t *enc = &flush_enc;
 
-    for(uint8_t i = 0; i < image_count; i++)
-    {
-        *(uint16_t *)(header + pos) = (uint16_t)strlen(whitelist.list[i].path);
-        pos += 2;
-        memcpy(header + pos, whitelist.list[i].path, strlen(whitelist.list[i].path));
-        pos += strlen(whitelist.list[i].path);
-    }
-
-    //[header] [number of images - 2 bytes][imagename - no-null byte]
-    write_to_pipe(header, header_size);
+    enc_begin(enc, SEC_STATS);
+    enc_varint(enc, stats.traces);
+    enc_varint(enc, stats.instrumented);
+    enc_varint(enc, stats.jit_us);
+    enc_varint(enc, stats.writes);
+    enc_varint(enc, stats.bytes);
+    enc_varint(enc, stats.blocked_us);
+    enc_varint(enc, stats.threads);
+    enc_end(enc);
+    enc_flush(enc);
+    memset(&stats, 0, sizeof(stats));
 }
 
 /*
- * Main and usage
+ * Writes everything that has been recorded so far to the pipe,
+ * leaving the maps and the buckets empty. The application threads
+ * must not be running, i.e. it is called at exit or from the thread
+ * that runs the persistent loop.
  */
-KNOB<std::string> 
-knob_database(
-        KNOB_MODE_WRITEONCE, 
-        "pintool",
-        "o", "", 
-        "specify an output file that will be generated from the target executable"
-        );
+VOID
+trace_flush()
+{
+    if (dedup_mode)
+        dedup_flush();
+    if (edge_mode)
+        edge_flush();
+    if (cmp_log_mode)
+        cmp_flush();
+    bucket_flush(bucket);
 
-KNOB<std::string>
-knob_event(
-    KNOB_MODE_WRITEONCE,
-    "pintool",
-    "e", "",
-    "windows only - the name of event");
+    for (bucket_t *bkt = thread_buckets; bkt; bkt = bkt->next)
+        bucket_flush(bkt);
 
-KNOB<std::string> 
-knob_whitelist(
-        KNOB_MODE_APPEND, 
-        "pintool",
-        "wht", "",
-        "list of image names to instrument"
-        );
+    // the records above refer to it
+    if (trace_batch_mode)
+        trace_table_write();
+    stats_flush();
+
+    // the driver reads the trace up to the status of the run, or EOF
+    async_drain();
+}
 
 void
 pin_finish(INT32 code, VOID *v)
 {
+    // what this run has compiled, the fork server included
+    if(tcache_dir)
+        tcache_save();
+
+    // the fork server itself never writes a trace, neither
+    // does the persistent mode between two iterations.
+    if ((forksrv_mode && !forksrv_child) ||
+            (persist_mode && !persist_running))
+    {
+        LOG("fork server finished\n");
+        return;
+    }
+
     char buffer[100];
     snprintf(buffer, 99, "pin_finish, bbls hit: %lu\n", bbls_count);
     LOG(buffer);
-    write_to_pipe(bucket->start, (bucket->curr - bucket->start) * sizeof(node_t));
-#ifdef TARGET_LINUX
-    LOG("closing fifo");
-    close(pipeHandle);
-#elif TARGET_WINDOWS
-    CloseHandle(pipeHandle);
-    CloseHandle(TimeoutEvent);
-#else
-#error "This system is not supported."
-#endif
+    trace_flush();
+
+    // late thread fini callbacks must not write anymore
+    PIN_GetLock(&output_lock, PIN_ThreadId() + 1);
+    output_closed = true;
+    close_output();
+    PIN_ReleaseLock(&output_lock);
+#ifdef TARGET_WINDOWS
+    WIN32_API::CloseHandle(TimeoutEvent);
+#endif /* TARGET_WINDOWS */
 }
 
 INT32
@@ -578,15 +3966,62 @@ main(int argc, char **argv) {
         return usage();
     }
 
-    pipe_size = init_fifo(knob_database.Value().c_str());
+    shm_mode = knob_shm.Value();
+    PIN_InitLock(&output_lock);
+    PIN_InitLock(&write_lock);
+    PIN_InitLock(&budget_lock);
+    timeout_ms = knob_timeout.Value();
+    timeout_cpu = knob_cputime.Value();
+    bbl_limit = knob_bblimit.Value();
+
+#ifdef TARGET_LINUX
+    forksrv_mode = knob_forksrv.Value().size() > 0;
+    persist_mode = !forksrv_mode && knob_persist.Value().size() > 0;
+    if(forksrv_mode || persist_mode) {
+        if(!knob_ctl.Value().size()) {
+            LOG("Error in arguments (control FIFO was not set).\n");
+            return usage();
+        }
+        forksrv_entry = forksrv_mode ? knob_forksrv.Value() : knob_persist.Value();
+        forksrv_ctl = knob_ctl.Value();
+        persist_max_iters = knob_iters.Value();
+        PIN_InitSymbols();
+    }
+
+    // the output is opened for each test case
+    if(forksrv_mode || persist_mode)
+        pipe_size = shm_mode ? SHM_BUCKET_SIZE : get_pipe_max_size();
+    else
+#endif /* TARGET_LINUX */
+        pipe_size = init_output(knob_database.Value().c_str());
 
     if(!pipe_size) {
-        LOG("init_fifo() failed\n");
+        LOG("init_output() failed\n");
         fprintf(stderr, "Unable to make a fifo.\n");
         return -1;
     }
     LOG("pipe ok\n");
 
+    // the children of the fork server do not inherit the writer
+    async_mode = knob_async.Value() > 0 && !forksrv_mode;
+    if (knob_async.Value() && !async_mode)
+        LOG("[!] -async is ignored along with -forksrv\n");
+    if (async_mode)
+    {
+        // the buckets no longer have to fit the pipe, the shared
+        // memory keeps its own size
+        if (!shm_mode)
+        {
+            pipe_size = knob_bufsize.Value() < 4096 ? 4096 : knob_bufsize.Value();
+            pipe_size <<= 1;
+        }
+        if (async_init(knob_async.Value(), pipe_size >> 1))
+        {
+            LOG("[!] Could not allocate the output buffers\n");
+            return -1;
+        }
+    }
+
 #ifdef TARGET_WINDOWS
     if(!knob_event.Value().size()) {
         LOG("Error in arguments (event was not set).\n");
@@ -610,13 +4045,89 @@ main(int argc, char **argv) {
 #endif /* TARGET_WINDOWS */
 
 
+    // the coverage gathered before the entry routine must reach
+    // every child, so the fork server implies the dedup map. In
+    // persistent mode it is put back before every iteration.
+    hit_count_mode = knob_hit_counts.Value();
+    dedup_mode = knob_dedup.Value() || forksrv_mode || persist_mode ||
+        hit_count_mode;
+    edge_mode = knob_edges.Value();
+    stack_hash_mode = knob_stack_hash.Value();
+    cmp_log_mode = knob_cmp_log.Value();
+
+    // edges and hit counts have to be observed on every execution and
+    // a persistent iteration must see the blocks of the previous ones.
+    first_hit_mode = knob_first_hit.Value() && !edge_mode && !persist_mode &&
+        !hit_count_mode;
+    if (knob_first_hit.Value() && !first_hit_mode)
+        LOG("[!] -firsthit is ignored along with -edges, -hitcounts or -persist\n");
+    dedup_mode = dedup_mode || first_hit_mode;
+
+    // the maps of the dedup mode are cheaper still
+    trace_batch_mode = knob_trace_batch.Value() && !dedup_mode;
+    if (knob_trace_batch.Value() && !trace_batch_mode)
+        LOG("[!] -tracebatch is ignored along with the dedup map\n");
+    if (edge_mode)
+    {
+        prev_loc_reg = PIN_ClaimToolRegister();
+        if (!REG_valid(prev_loc_reg))
+        {
+            LOG("PIN_ClaimToolRegister failed.\n");
+            return -1;
+        }
+    }
+
+    bucket_size = pipe_size;
     bucket = init_bucket(pipe_size);
+    if (bucket == NULL || enc_init(&flush_enc, pipe_size >> 1))
+    {
+        LOG("[!] Could not allocate the buckets\n");
+        return -1;
+    }
+    bucket_key = PIN_CreateThreadDataKey(NULL);
+    bucket_reg = PIN_ClaimToolRegister();
+    if (!REG_valid(bucket_reg))
+    {
+        LOG("PIN_ClaimToolRegister failed.\n");
+        return -1;
+    }
+    PIN_AddThreadStartFunction(thread_start, NULL);
+    PIN_AddThreadFiniFunction(thread_fini, NULL);
     LOG("bucket ok\n");
     wht_init(&knob_whitelist);
     LOG("whitelist ok\n");
+    filter_init(&knob_range, &knob_function);
+    if (knob_tcache.Value().size())
+    {
+        tcache_dir = knob_tcache.Value().c_str();
+        tcache_config = 14695981039346656037ULL;
+        for (UINT32 i = 0; i < knob_idmp.NumberOfValues(); i++)
+            tcache_config = hash64(tcache_config, knob_idmp.Value(i).c_str(),
+                    knob_idmp.Value(i).size() + 1);
+        for (UINT32 i = 0; i < knob_range.NumberOfValues(); i++)
+            tcache_config = hash64(tcache_config, knob_range.Value(i).c_str(),
+                    knob_range.Value(i).size() + 1);
+        for (UINT32 i = 0; i < knob_function.NumberOfValues(); i++)
+            tcache_config = hash64(tcache_config, knob_function.Value(i).c_str(),
+                    knob_function.Value(i).size() + 1);
+    }
+    for (UINT32 i = 0; i < knob_idmp.NumberOfValues(); i++)
+    {
+        if (tcache_dir)
+            idmp_defer(knob_idmp.Value(i).c_str());
+        else
+            idmp_load(knob_idmp.Value(i).c_str());
+    }
+    for (off_t i = 0; i < whitelist.len; i++)
+        filter_sort(whitelist.list[i].filter);
 
-    write_header();
-    LOG("write_header ok\n");
+    // the server has no output, every child opens its own, and
+    // so does every persistent iteration
+    if(!forksrv_mode && !persist_mode)
+    {
+        write_header();
+        LOG("write_header ok\n");
+    }
 
     IMG_AddInstrumentFunction(img_load, NULL);
     IMG_AddUnloadFunction(img_unload, NULL);
@@ -628,12 +4139,6 @@ main(int argc, char **argv) {
      * watch is the event was set. On the other hand, on Linux, a SIGUSR2
      * signal is sent to the process.
      */
-    PinThreadLock = (PIN_LOCK *)malloc(sizeof(PIN_LOCK));
-    PIN_InitLock(PinThreadLock);
-    if(PinThreadLock == NULL) {
-        LOG("PIN_InitLock failed.\n");
-        return usage();
-    }
     THREADID tid;
     tid = PIN_SpawnInternalThread(CheckTerminationEvent, NULL, 0, &InternalPINThreadUid);
     if(tid == INVALID_THREADID) {
@@ -641,15 +4146,46 @@ main(int argc, char **argv) {
         return -2;
     }
     PIN_AddPrepareForFiniFunction(TerminateInternalPINThreads, NULL);
+#else
+    // the fork server enforces the timeout of its children itself
+    if(timeout_ms && !forksrv_mode) {
+        THREADID tid;
+        tid = PIN_SpawnInternalThread(watchdog, NULL, 0, &InternalPINThreadUid);
+        if(tid == INVALID_THREADID) {
+            LOG("PIN_SpawnInternalThread failed.\n");
+            return -2;
+        }
+        PIN_AddPrepareForFiniFunction(TerminateInternalPINThreads, NULL);
+    }
 #endif /* TARGET_WINDOWS */
 
+    if (async_mode)
+    {
+        THREADID tid;
+        tid = PIN_SpawnInternalThread(async_writer, NULL, 0, &async_uid);
+        if(tid == INVALID_THREADID) {
+            LOG("PIN_SpawnInternalThread failed.\n");
+            return -2;
+        }
+        PIN_AddPrepareForFiniFunction(async_stop, NULL);
+    }
+
     PIN_AddContextChangeFunction(context_change_cb, 0);
+#ifdef TARGET_LINUX
+    // only to learn the faulting address of a crash
+    PIN_InterceptSignal(SIGSEGV, fault_intercept, NULL);
+    PIN_InterceptSignal(SIGBUS, fault_intercept, NULL);
+#endif /* TARGET_LINUX */
 
     TRACE_AddInstrumentFunction(trace_callback, NULL);
 
     // cleanup code
     PIN_AddFiniFunction(pin_finish, NULL);
 
+    // the servers arm the budget for every test case
+    if(!forksrv_mode && !persist_mode)
+        budget_arm();
+
     // never returns
     PIN_StartProgram();
 
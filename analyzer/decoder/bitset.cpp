@@ -0,0 +1,501 @@
+/*
+ * Dense bitsets for the sets of basic blocks of the traces, see
+ * blockset.py. A bit is the id of an IDA basic block in the BlockCache
+ * of its image.
+ *
+ * The difference, union and intersection kernels use AVX2 when the CPU
+ * supports it, with a popcount made of nibble lookups (vpshufb) summed
+ * by vpsadbw, since AVX2 has no vector popcount. Otherwise they fall
+ * back to 64 bit words.
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define WORD_BITS 64
+#define WORDS(nbits) (((nbits) + WORD_BITS - 1) / WORD_BITS)
+
+typedef struct
+{
+    PyObject_HEAD
+    uint64_t *words;
+    Py_ssize_t nwords;
+} bitset_t;
+
+/* The operations on a pair of words */
+enum
+{
+    OP_ANDNOT, // a & ~b
+    OP_AND,
+    OP_OR,
+};
+
+static uint64_t
+word_op(uint64_t a, uint64_t b, int op)
+{
+    switch (op)
+    {
+    case OP_ANDNOT:
+        return a & ~b;
+    case OP_AND:
+        return a & b;
+    default:
+        return a | b;
+    }
+}
+
+static uint64_t
+popcount64(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (uint64_t)__builtin_popcountll(v);
+#else
+    v = v - ((v >> 1) & 0x5555555555555555ULL);
+    v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+    v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (v * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+static uint64_t
+count_scalar(const uint64_t *a, const uint64_t *b, Py_ssize_t n, int op)
+{
+    uint64_t count = 0;
+    for (Py_ssize_t i = 0; i < n; i++)
+        count += popcount64(word_op(a[i], b[i], op));
+    return count;
+}
+
+static void
+apply_scalar(uint64_t *a, const uint64_t *b, Py_ssize_t n, int op)
+{
+    for (Py_ssize_t i = 0; i < n; i++)
+        a[i] = word_op(a[i], b[i], op);
+}
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2"))) static inline __m256i
+vec_op(__m256i a, __m256i b, int op)
+{
+    switch (op)
+    {
+    case OP_ANDNOT:
+        return _mm256_andnot_si256(b, a);
+    case OP_AND:
+        return _mm256_and_si256(a, b);
+    default:
+        return _mm256_or_si256(a, b);
+    }
+}
+
+/* the popcount of every 64 bit lane */
+__attribute__((target("avx2"))) static inline __m256i
+popcount256(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+
+    __m256i lo = _mm256_and_si256(v, low);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+    __m256i cnt = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lookup, lo),
+            _mm256_shuffle_epi8(lookup, hi));
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2"))) static uint64_t
+count_avx2(const uint64_t *a, const uint64_t *b, Py_ssize_t n, int op)
+{
+    __m256i acc = _mm256_setzero_si256();
+    Py_ssize_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        acc = _mm256_add_epi64(acc, popcount256(vec_op(va, vb, op)));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+        count_scalar(a + i, b + i, n - i, op);
+}
+
+__attribute__((target("avx2"))) static void
+apply_avx2(uint64_t *a, const uint64_t *b, Py_ssize_t n, int op)
+{
+    Py_ssize_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        _mm256_storeu_si256((__m256i *)(a + i), vec_op(va, vb, op));
+    }
+    apply_scalar(a + i, b + i, n - i, op);
+}
+#endif /* HAVE_AVX2 */
+
+// selected once the module is initialized
+static uint64_t (*count_words)(const uint64_t *, const uint64_t *,
+        Py_ssize_t, int) = count_scalar;
+static void (*apply_words)(uint64_t *, const uint64_t *,
+        Py_ssize_t, int) = apply_scalar;
+
+// defined along with its methods, below
+extern PyTypeObject BitsetType;
+
+static bitset_t *
+bitset_alloc(Py_ssize_t nwords)
+{
+    bitset_t *self = PyObject_New(bitset_t, &BitsetType);
+    if (self == NULL)
+        return NULL;
+
+    // at least one word, so that words is never NULL
+    self->nwords = nwords > 0 ? nwords : 1;
+    self->words = (uint64_t *)calloc(self->nwords, sizeof(uint64_t));
+    if (self->words == NULL)
+    {
+        self->nwords = 0;
+        Py_DECREF(self);
+        return (bitset_t *)PyErr_NoMemory();
+    }
+    return self;
+}
+
+static int
+bitset_grow(bitset_t *self, Py_ssize_t nwords)
+{
+    if (nwords <= self->nwords)
+        return 0;
+
+    uint64_t *words = (uint64_t *)realloc(self->words, nwords * sizeof(uint64_t));
+    if (words == NULL)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(words + self->nwords, 0, (nwords - self->nwords) * sizeof(uint64_t));
+    self->words = words;
+    self->nwords = nwords;
+    return 0;
+}
+
+static bitset_t *
+bitset_arg(PyObject *args, const char *format)
+{
+    PyObject *other;
+    if (!PyArg_ParseTuple(args, format, &BitsetType, &other))
+        return NULL;
+    return (bitset_t *)other;
+}
+
+static uint64_t
+count_tail(const bitset_t *bs, Py_ssize_t from)
+{
+    uint64_t count = 0;
+    for (Py_ssize_t i = from; i < bs->nwords; i++)
+        count += popcount64(bs->words[i]);
+    return count;
+}
+
+static Py_ssize_t
+min_words(const bitset_t *a, const bitset_t *b)
+{
+    return a->nwords < b->nwords ? a->nwords : b->nwords;
+}
+
+static PyObject *
+bitset_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t nbits = 0;
+    if (!PyArg_ParseTuple(args, "|n:Bitset", &nbits))
+        return NULL;
+    if (nbits < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "negative size");
+        return NULL;
+    }
+    return (PyObject *)bitset_alloc(WORDS(nbits));
+}
+
+static void
+bitset_dealloc(bitset_t *self)
+{
+    free(self->words);
+    PyObject_Del(self);
+}
+
+static PyObject *
+bitset_add(bitset_t *self, PyObject *args)
+{
+    Py_ssize_t bit;
+    if (!PyArg_ParseTuple(args, "n:add", &bit))
+        return NULL;
+    if (bit < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "negative bit");
+        return NULL;
+    }
+    if (bitset_grow(self, WORDS(bit + 1)) < 0)
+        return NULL;
+
+    self->words[bit / WORD_BITS] |= 1ULL << (bit % WORD_BITS);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+bitset_discard(bitset_t *self, PyObject *args)
+{
+    Py_ssize_t bit;
+    if (!PyArg_ParseTuple(args, "n:discard", &bit))
+        return NULL;
+    if (bit >= 0 && bit / WORD_BITS < self->nwords)
+        self->words[bit / WORD_BITS] &= ~(1ULL << (bit % WORD_BITS));
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+bitset_contains(bitset_t *self, PyObject *args)
+{
+    Py_ssize_t bit;
+    if (!PyArg_ParseTuple(args, "n:contains", &bit))
+        return NULL;
+    if (bit < 0 || bit / WORD_BITS >= self->nwords)
+        Py_RETURN_FALSE;
+    return PyBool_FromLong((self->words[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1);
+}
+
+static PyObject *
+bitset_count(bitset_t *self)
+{
+    return PyLong_FromUnsignedLongLong(count_tail(self, 0));
+}
+
+static PyObject *
+bitset_copy(bitset_t *self)
+{
+    bitset_t *copy = bitset_alloc(self->nwords);
+    if (copy != NULL)
+        memcpy(copy->words, self->words, self->nwords * sizeof(uint64_t));
+    return (PyObject *)copy;
+}
+
+static PyObject *
+bitset_update(bitset_t *self, PyObject *args)
+{
+    bitset_t *other = bitset_arg(args, "O!:update");
+    if (other == NULL || bitset_grow(self, other->nwords) < 0)
+        return NULL;
+
+    apply_words(self->words, other->words, other->nwords, OP_OR);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+bitset_difference_update(bitset_t *self, PyObject *args)
+{
+    bitset_t *other = bitset_arg(args, "O!:difference_update");
+    if (other == NULL)
+        return NULL;
+
+    apply_words(self->words, other->words, min_words(self, other), OP_ANDNOT);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+bitset_difference(bitset_t *self, PyObject *args)
+{
+    bitset_t *other = bitset_arg(args, "O!:difference");
+    if (other == NULL)
+        return NULL;
+
+    bitset_t *result = (bitset_t *)bitset_copy(self);
+    if (result != NULL)
+        apply_words(result->words, other->words, min_words(self, other), OP_ANDNOT);
+    return (PyObject *)result;
+}
+
+static PyObject *
+bitset_difference_count(bitset_t *self, PyObject *args)
+{
+    bitset_t *other = bitset_arg(args, "O!:difference_count");
+    if (other == NULL)
+        return NULL;
+
+    Py_ssize_t n = min_words(self, other);
+    return PyLong_FromUnsignedLongLong(
+            count_words(self->words, other->words, n, OP_ANDNOT) +
+            count_tail(self, n));
+}
+
+static PyObject *
+bitset_intersection_count(bitset_t *self, PyObject *args)
+{
+    bitset_t *other = bitset_arg(args, "O!:intersection_count");
+    if (other == NULL)
+        return NULL;
+
+    return PyLong_FromUnsignedLongLong(count_words(self->words, other->words,
+            min_words(self, other), OP_AND));
+}
+
+static PyObject *
+bitset_union_count(bitset_t *self, PyObject *args)
+{
+    bitset_t *other = bitset_arg(args, "O!:union_count");
+    if (other == NULL)
+        return NULL;
+
+    Py_ssize_t n = min_words(self, other);
+    return PyLong_FromUnsignedLongLong(
+            count_words(self->words, other->words, n, OP_OR) +
+            count_tail(self, n) + count_tail(other, n));
+}
+
+static PyObject *
+bitset_indices(bitset_t *self)
+{
+    PyObject *list = PyList_New(0);
+    if (list == NULL)
+        return NULL;
+
+    for (Py_ssize_t i = 0; i < self->nwords; i++)
+    {
+        uint64_t word = self->words[i];
+        while (word)
+        {
+            // the lowest set bit
+            Py_ssize_t bit = i * WORD_BITS + (Py_ssize_t)popcount64((word & -word) - 1);
+            word &= word - 1;
+
+            PyObject *item = PyInt_FromSsize_t(bit);
+            if (item == NULL || PyList_Append(list, item) < 0)
+            {
+                Py_XDECREF(item);
+                Py_DECREF(list);
+                return NULL;
+            }
+            Py_DECREF(item);
+        }
+    }
+    return list;
+}
+
+/* The words in little endian, i.e. bit i is bit i % 8 of byte i / 8. */
+static PyObject *
+bitset_tobytes(bitset_t *self)
+{
+    PyObject *data = PyString_FromStringAndSize(NULL, self->nwords * 8);
+    if (data == NULL)
+        return NULL;
+
+    unsigned char *p = (unsigned char *)PyString_AS_STRING(data);
+    for (Py_ssize_t i = 0; i < self->nwords; i++)
+        for (int j = 0; j < 8; j++)
+            *p++ = (unsigned char)(self->words[i] >> (8 * j));
+    return data;
+}
+
+static PyObject *
+bitset_frombytes(PyObject *type, PyObject *args)
+{
+    const unsigned char *data;
+    Py_ssize_t size;
+    if (!PyArg_ParseTuple(args, "s#:frombytes", &data, &size))
+        return NULL;
+
+    bitset_t *self = bitset_alloc((size + 7) / 8);
+    if (self == NULL)
+        return NULL;
+    for (Py_ssize_t i = 0; i < size; i++)
+        self->words[i / 8] |= (uint64_t)data[i] << (8 * (i % 8));
+    return (PyObject *)self;
+}
+
+static PyMethodDef bitset_methods[] = {
+    {"add", (PyCFunction)bitset_add, METH_VARARGS,
+        "add(bit) -> sets the bit, growing the bitset if needed"},
+    {"discard", (PyCFunction)bitset_discard, METH_VARARGS,
+        "discard(bit) -> clears the bit"},
+    {"contains", (PyCFunction)bitset_contains, METH_VARARGS,
+        "contains(bit) -> True if the bit is set"},
+    {"count", (PyCFunction)bitset_count, METH_NOARGS,
+        "count() -> number of set bits"},
+    {"copy", (PyCFunction)bitset_copy, METH_NOARGS,
+        "copy() -> a copy of the bitset"},
+    {"update", (PyCFunction)bitset_update, METH_VARARGS,
+        "update(other) -> in place union"},
+    {"difference_update", (PyCFunction)bitset_difference_update, METH_VARARGS,
+        "difference_update(other) -> in place difference"},
+    {"difference", (PyCFunction)bitset_difference, METH_VARARGS,
+        "difference(other) -> a new bitset with the bits not in other"},
+    {"difference_count", (PyCFunction)bitset_difference_count, METH_VARARGS,
+        "difference_count(other) -> number of bits not in other"},
+    {"intersection_count", (PyCFunction)bitset_intersection_count, METH_VARARGS,
+        "intersection_count(other) -> number of bits also in other"},
+    {"union_count", (PyCFunction)bitset_union_count, METH_VARARGS,
+        "union_count(other) -> number of bits in either bitset"},
+    {"indices", (PyCFunction)bitset_indices, METH_NOARGS,
+        "indices() -> sorted list of the set bits"},
+    {"tobytes", (PyCFunction)bitset_tobytes, METH_NOARGS,
+        "tobytes() -> the bitset as a little endian string"},
+    {"frombytes", (PyCFunction)bitset_frombytes, METH_VARARGS | METH_CLASS,
+        "frombytes(data) -> the bitset of a string from tobytes()"},
+    {NULL, NULL, 0, NULL}
+};
+
+PyTypeObject BitsetType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "bitset.Bitset",            /* tp_name */
+    sizeof(bitset_t),           /* tp_basicsize */
+    0,                          /* tp_itemsize */
+    (destructor)bitset_dealloc, /* tp_dealloc */
+};
+
+static PyObject *
+has_avx2(PyObject *self)
+{
+    return PyBool_FromLong(count_words != count_scalar);
+}
+
+static PyMethodDef module_methods[] = {
+    {"has_avx2", (PyCFunction)has_avx2, METH_NOARGS,
+        "has_avx2() -> True if the AVX2 kernels are in use"},
+    {NULL, NULL, 0, NULL}
+};
+
+PyMODINIT_FUNC
+initbitset(void)
+{
+    BitsetType.tp_flags = Py_TPFLAGS_DEFAULT;
+    BitsetType.tp_doc = "Bitset(nbits) -> dense bitset of basic block ids";
+    BitsetType.tp_methods = bitset_methods;
+    BitsetType.tp_new = bitset_new;
+    if (PyType_Ready(&BitsetType) < 0)
+        return;
+
+#ifdef HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+    {
+        count_words = count_avx2;
+        apply_words = apply_avx2;
+    }
+#endif
+
+    PyObject *module = Py_InitModule("bitset", module_methods);
+    if (module == NULL)
+        return;
+
+    Py_INCREF(&BitsetType);
+    PyModule_AddObject(module, "Bitset", (PyObject *)&BitsetType);
+}
@@ -0,0 +1,24 @@
+#!/usr/bin/env python
+
+'''
+    Builds the native trace decoder and the bitsets of the traces, which
+    are used by tracer.py and blockset.py when they are available:
+
+    python setup.py build_ext --inplace
+'''
+
+from distutils.core import setup, Extension
+
+setup(
+    name='tracedecoder',
+    ext_modules=[
+        Extension(
+            'tracedecoder',
+            sources=['tracedecoder.cpp'],
+        ),
+        Extension(
+            'bitset',
+            sources=['bitset.cpp'],
+        ),
+    ],
+)
@@ -0,0 +1,656 @@
+/*
+ * Native decoder of the trace format v2 that is written by the
+ * coverage pintool, see traceformat.py for its description.
+ *
+ * It decodes the sections of a trace in bulk, or incrementally while
+ * the trace is read, and maps the offsets of the Pin basic blocks to
+ * the IDA basic blocks, using a compiled copy of the ranges of a
+ * BlockCache. tracer.py falls back to the pure Python decoder if the
+ * module has not been built.
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define SEC_BLOCKS 1
+#define SEC_RAW 2
+#define SEC_EDGES 3
+#define SEC_EVENT 4
+#define SEC_TRACES 5
+#define SEC_TRACE_TABLE 6
+#define SEC_COUNTS 7
+#define SEC_CRASH 8
+#define SEC_CMPS 9
+#define SEC_STATS 10
+
+#define SEC_HEADER_SIZE 5
+#define TRACE_SKIP 0xFFFFFFFF // a block of the trace table that is not reported
+#define BLOCK_MAP_NAME "tracedecoder.BlockMap"
+
+#define UNZIGZAG(v) (((v) >> 1) ^ (uint64_t)-(int64_t)((v) & 1))
+
+/* The sorted (start, end) ranges of the IDA basic blocks of an image. */
+typedef struct
+{
+    std::vector<uint64_t> starts;
+    std::vector<uint64_t> ends;
+} block_map_t;
+
+/* The basic blocks of an image hit by the trace */
+typedef struct
+{
+    const block_map_t *map;
+    std::vector<uint8_t> seen;
+    std::vector<uint32_t> hits; // indices of the unique blocks
+    std::vector<uint8_t> counts; // hit count buckets, from SEC_COUNTS
+    uint64_t total;
+} image_state_t;
+
+typedef struct
+{
+    uint32_t image;
+    std::vector<uint64_t> offsets;
+} trace_entry_t;
+
+typedef struct
+{
+    const uint8_t *p;
+    const uint8_t *end;
+    bool ok;
+} reader_t;
+
+static uint64_t
+read_varint(reader_t *rd)
+{
+    uint64_t value = 0;
+    unsigned int shift = 0;
+
+    while (rd->p < rd->end)
+    {
+        uint8_t byte = *rd->p++;
+        if (shift < 64)
+            value |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80)
+            return value;
+        shift += 7;
+    }
+    rd->ok = false;
+    return 0;
+}
+
+static uint32_t
+read_u32(reader_t *rd)
+{
+    uint32_t value;
+    if (rd->end - rd->p < 4)
+    {
+        rd->p = rd->end;
+        rd->ok = false;
+        return 0;
+    }
+    memcpy(&value, rd->p, sizeof(value));
+    rd->p += 4;
+    return value;
+}
+
+static bool
+more(reader_t *rd)
+{
+    return rd->ok && rd->p < rd->end;
+}
+
+/*
+ * Returns the index of the IDA basic block that contains the offset,
+ * or -1. Same as BlockCache.get_cached.
+ */
+static long
+block_lookup(const block_map_t *map, uint64_t offset)
+{
+    std::vector<uint64_t>::const_iterator it = std::upper_bound(
+            map->starts.begin(), map->starts.end(), offset);
+    if (it == map->starts.begin())
+        return -1;
+
+    long i = (long)(it - map->starts.begin()) - 1;
+    if (map->starts[i] == offset || offset < map->ends[i])
+        return i;
+    return -1;
+}
+
+/*
+ * Adds a hit of the block that contains the offset. A bucket of zero
+ * means a single hit without a hit count, otherwise the buckets of the
+ * block are or'ed together, same as Trace.add_bbl.
+ */
+static void
+add_offset(image_state_t *img, uint64_t offset, uint8_t bucket = 0)
+{
+    if (img->map == NULL)
+        return;
+
+    long i = block_lookup(img->map, offset);
+    if (i < 0)
+        return;
+
+    if (!img->seen[i])
+    {
+        img->seen[i] = 1;
+        img->hits.push_back((uint32_t)i);
+    }
+    if (!bucket)
+    {
+        img->total++;
+        return;
+    }
+
+    if (img->counts.empty())
+        img->counts.assign(img->map->starts.size(), 0);
+    img->counts[i] |= bucket;
+    img->total += bucket;
+}
+
+static void
+free_block_map(PyObject *capsule)
+{
+    delete (block_map_t *)PyCapsule_GetPointer(capsule, BLOCK_MAP_NAME);
+}
+
+static PyObject *
+compile_blocks(PyObject *self, PyObject *args)
+{
+    PyObject *ranges;
+    if (!PyArg_ParseTuple(args, "O:compile_blocks", &ranges))
+        return NULL;
+
+    PyObject *seq = PySequence_Fast(ranges, "ranges must be a sequence");
+    if (seq == NULL)
+        return NULL;
+
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    std::vector<std::pair<uint64_t, uint64_t> > pairs;
+    pairs.reserve(n);
+    for (Py_ssize_t i = 0; i < n; i++)
+    {
+        unsigned long long start, end;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "KK", &start, &end))
+        {
+            Py_DECREF(seq);
+            return NULL;
+        }
+        pairs.push_back(std::make_pair((uint64_t)start, (uint64_t)end));
+    }
+    Py_DECREF(seq);
+    std::sort(pairs.begin(), pairs.end());
+
+    block_map_t *map = new block_map_t;
+    map->starts.reserve(pairs.size());
+    map->ends.reserve(pairs.size());
+    for (size_t i = 0; i < pairs.size(); i++)
+    {
+        map->starts.push_back(pairs[i].first);
+        map->ends.push_back(pairs[i].second);
+    }
+
+    PyObject *capsule = PyCapsule_New(map, BLOCK_MAP_NAME, free_block_map);
+    if (capsule == NULL)
+        delete map;
+    return capsule;
+}
+
+static bool
+decode_trace_table(reader_t *rd, std::vector<trace_entry_t> *table)
+{
+    uint64_t id = read_varint(rd);
+    while (more(rd))
+    {
+        trace_entry_t entry;
+        entry.image = (uint32_t)read_varint(rd);
+        uint64_t count = read_varint(rd);
+        uint64_t offset = 0;
+        for (uint64_t i = 0; i < count && rd->ok; i++)
+        {
+            uint64_t delta = read_varint(rd);
+            offset += UNZIGZAG(delta);
+            entry.offsets.push_back(offset);
+        }
+
+        if (id >= table->size())
+            table->resize(id + 1);
+        (*table)[id++] = entry;
+    }
+    return rd->ok;
+}
+
+/* The state of a trace that is decoded as it is read */
+typedef struct
+{
+    PyObject *maps; // keeps the block maps of the images alive
+    std::vector<image_state_t> images;
+    std::vector<std::pair<uint64_t, uint64_t> > edges;
+    std::vector<uint64_t> traces; // resolved once the table is complete
+    std::vector<trace_entry_t> table;
+    std::vector<std::pair<uint8_t, std::string> > rest;
+    std::string pending; // the beginning of a section that is incomplete
+    bool crashed;
+    bool ok;
+} decoder_state_t;
+
+/*
+ * Decodes the complete sections at the start of data and returns the
+ * size of what has been decoded. A malformed section clears st->ok.
+ */
+static size_t
+decode_sections(const uint8_t *data, size_t size, decoder_state_t *st)
+{
+    std::vector<image_state_t> &images = st->images;
+    const uint8_t *p = data, *end = data + size;
+
+    while (end - p >= SEC_HEADER_SIZE)
+    {
+        uint8_t type = p[0];
+        uint32_t length;
+        memcpy(&length, p + 1, sizeof(length));
+        if ((size_t)(end - p - SEC_HEADER_SIZE) < length)
+            break;
+
+        reader_t rd = {p + SEC_HEADER_SIZE, p + SEC_HEADER_SIZE + length, true};
+        p += SEC_HEADER_SIZE + length;
+
+        switch (type)
+        {
+        case SEC_BLOCKS:
+        {
+            uint64_t ino = read_varint(&rd);
+            if (!rd.ok || ino >= images.size())
+            {
+                st->ok = false;
+                return p - data;
+            }
+            uint64_t offset = 0;
+            while (more(&rd))
+            {
+                offset += read_varint(&rd);
+                if (rd.ok)
+                    add_offset(&images[ino], offset);
+            }
+            break;
+        }
+        case SEC_COUNTS:
+        {
+            uint64_t ino = read_varint(&rd);
+            if (!rd.ok || ino >= images.size())
+            {
+                st->ok = false;
+                return p - data;
+            }
+            uint64_t offset = 0;
+            while (more(&rd))
+            {
+                offset += read_varint(&rd);
+                uint64_t bucket = read_varint(&rd);
+                if (rd.ok && bucket)
+                    add_offset(&images[ino], offset,
+                            (uint8_t)std::min(bucket, (uint64_t)0xff));
+            }
+            break;
+        }
+        case SEC_RAW:
+        {
+            read_u32(&rd);
+            uint64_t offset = 0;
+            while (more(&rd))
+            {
+                uint64_t ino = read_varint(&rd);
+                uint64_t delta = read_varint(&rd);
+                if (!rd.ok)
+                    break;
+                if (ino >= images.size())
+                {
+                    st->ok = false;
+                    return p - data;
+                }
+                offset += UNZIGZAG(delta);
+                add_offset(&images[ino], offset);
+            }
+            break;
+        }
+        case SEC_EDGES:
+        {
+            uint64_t edge = 0;
+            while (more(&rd))
+            {
+                edge += read_varint(&rd);
+                uint64_t bucket = read_varint(&rd);
+                if (rd.ok)
+                    st->edges.push_back(std::make_pair(edge, bucket));
+            }
+            break;
+        }
+        case SEC_EVENT:
+        {
+            read_u32(&rd);
+            uint64_t info = read_varint(&rd);
+            if (rd.ok && info != 0xC)
+                st->crashed = true;
+            break;
+        }
+        case SEC_TRACES:
+            read_u32(&rd);
+            while (more(&rd))
+            {
+                uint64_t record = read_varint(&rd);
+                if (rd.ok)
+                    st->traces.push_back(record);
+            }
+            break;
+        case SEC_TRACE_TABLE:
+            decode_trace_table(&rd, &st->table);
+            break;
+        case SEC_CRASH:
+            st->crashed = true;
+            // fall through
+        case SEC_CMPS:
+        case SEC_STATS:
+            // left to tracer.py
+            st->rest.push_back(std::make_pair(type,
+                    std::string((const char *)rd.p, rd.end - rd.p)));
+            break;
+        default:
+            break;
+        }
+    }
+    return p - data;
+}
+
+static bool
+decoder_init(decoder_state_t *st, PyObject *maps)
+{
+    st->maps = PySequence_Fast(maps, "maps must be a sequence");
+    st->crashed = false;
+    st->ok = true;
+    if (st->maps == NULL)
+        return false;
+
+    Py_ssize_t nimg = PySequence_Fast_GET_SIZE(st->maps);
+    st->images.resize(nimg);
+    for (Py_ssize_t i = 0; i < nimg; i++)
+    {
+        PyObject *item = PySequence_Fast_GET_ITEM(st->maps, i);
+        st->images[i].map = NULL;
+        st->images[i].total = 0;
+        if (item == Py_None)
+            continue;
+
+        st->images[i].map = (block_map_t *)PyCapsule_GetPointer(item, BLOCK_MAP_NAME);
+        if (st->images[i].map == NULL)
+            return false;
+        st->images[i].seen.assign(st->images[i].map->starts.size(), 0);
+    }
+    return true;
+}
+
+/*
+ * Decodes the complete sections of the data, along with what is left
+ * of the previous data. The incomplete section at the end is kept for
+ * the next call.
+ */
+static void
+decoder_feed(decoder_state_t *st, const uint8_t *data, size_t size)
+{
+    if (!st->ok)
+        return;
+
+    if (st->pending.empty())
+    {
+        size_t used = decode_sections(data, size, st);
+        st->pending.assign((const char *)data + used, size - used);
+        return;
+    }
+
+    st->pending.append((const char *)data, size);
+    size_t used = decode_sections((const uint8_t *)st->pending.data(),
+            st->pending.size(), st);
+    st->pending.erase(0, used);
+}
+
+/*
+ * Returns the (blocks, totals, counts, edges, crashed, rest) tuple of
+ * decode(). Section truncated at the end of the trace are dropped,
+ * like traceformat.read_sections does.
+ */
+static PyObject *
+decoder_result(decoder_state_t *st)
+{
+    std::vector<image_state_t> &images = st->images;
+    Py_ssize_t nimg = (Py_ssize_t)images.size();
+
+    Py_BEGIN_ALLOW_THREADS
+    // the table follows the records that refer to it
+    for (size_t i = 0; st->ok && i < st->traces.size(); i++)
+    {
+        uint64_t id = st->traces[i] >> 16;
+        if (id >= st->table.size() || st->table[id].image >= images.size())
+        {
+            st->ok = false;
+            break;
+        }
+
+        trace_entry_t *entry = &st->table[id];
+        size_t count = std::min((size_t)(st->traces[i] & 0xffff), entry->offsets.size());
+        for (size_t j = 0; j < count; j++)
+            if (entry->offsets[j] != TRACE_SKIP)
+                add_offset(&images[entry->image], entry->offsets[j]);
+    }
+    st->traces.clear();
+    for (Py_ssize_t i = 0; i < nimg; i++)
+        std::sort(images[i].hits.begin(), images[i].hits.end());
+    Py_END_ALLOW_THREADS
+
+    bool ok = st->ok;
+    PyObject *blocks = PyList_New(nimg);
+    PyObject *totals = PyList_New(nimg);
+    PyObject *counts = PyList_New(nimg);
+    PyObject *edge_list = PyList_New(st->edges.size());
+    PyObject *rest_list = PyList_New(st->rest.size());
+    if (!ok)
+        PyErr_SetString(PyExc_ValueError, "malformed trace");
+
+    for (Py_ssize_t i = 0; ok && blocks && totals && counts && i < nimg; i++)
+    {
+        image_state_t *img = &images[i];
+        PyObject *hits = PyList_New(img->hits.size());
+        PyObject *buckets = Py_None;
+        if (!img->counts.empty())
+            buckets = PyList_New(img->hits.size());
+        else
+            Py_INCREF(buckets);
+        if (hits == NULL || buckets == NULL)
+        {
+            Py_XDECREF(hits);
+            Py_XDECREF(buckets);
+            ok = false;
+            break;
+        }
+        for (size_t j = 0; j < img->hits.size(); j++)
+        {
+            uint32_t k = img->hits[j];
+            PyList_SET_ITEM(hits, j, Py_BuildValue("(KK)",
+                    (unsigned long long)img->map->starts[k],
+                    (unsigned long long)img->map->ends[k]));
+            if (buckets != Py_None)
+                PyList_SET_ITEM(buckets, j, PyInt_FromLong(img->counts[k]));
+        }
+        PyList_SET_ITEM(blocks, i, hits);
+        PyList_SET_ITEM(counts, i, buckets);
+        PyList_SET_ITEM(totals, i, PyLong_FromUnsignedLongLong(img->total));
+    }
+    for (size_t i = 0; ok && edge_list && i < st->edges.size(); i++)
+    {
+        PyList_SET_ITEM(edge_list, i, Py_BuildValue("(KK)",
+                (unsigned long long)st->edges[i].first,
+                (unsigned long long)st->edges[i].second));
+    }
+    for (size_t i = 0; ok && rest_list && i < st->rest.size(); i++)
+    {
+        PyList_SET_ITEM(rest_list, i, Py_BuildValue("(is#)", st->rest[i].first,
+                st->rest[i].second.data(), (Py_ssize_t)st->rest[i].second.size()));
+    }
+
+    if (!ok || !blocks || !totals || !counts || !edge_list || !rest_list ||
+            PyErr_Occurred())
+    {
+        Py_XDECREF(blocks);
+        Py_XDECREF(totals);
+        Py_XDECREF(counts);
+        Py_XDECREF(edge_list);
+        Py_XDECREF(rest_list);
+        return NULL;
+    }
+    return Py_BuildValue("(NNNNON)", blocks, totals, counts, edge_list,
+            st->crashed ? Py_True : Py_False, rest_list);
+}
+
+/*
+ * decode(data, maps) -> (blocks, totals, counts, edges, crashed, rest)
+ *
+ * data holds the sections of the trace and maps the compiled block
+ * map of every image of the header, or None. blocks is a list with
+ * the sorted (start, end) tuples of the IDA blocks hit in every
+ * image, totals the number of hits per image, counts the hit count
+ * buckets of the blocks per image or None without SEC_COUNTS, edges
+ * a list of (edge index, bucket) tuples and rest a list with the (type,
+ * payload) tuples of the SEC_CRASH, SEC_CMPS and SEC_STATS sections.
+ */
+static PyObject *
+decode(PyObject *self, PyObject *args)
+{
+    const char *data;
+    Py_ssize_t size;
+    PyObject *maps;
+    if (!PyArg_ParseTuple(args, "s#O:decode", &data, &size, &maps))
+        return NULL;
+
+    decoder_state_t st;
+    PyObject *result = NULL;
+    if (decoder_init(&st, maps))
+    {
+        Py_BEGIN_ALLOW_THREADS
+        decode_sections((const uint8_t *)data, (size_t)size, &st);
+        Py_END_ALLOW_THREADS
+        result = decoder_result(&st);
+    }
+    Py_XDECREF(st.maps);
+    return result;
+}
+
+/*
+ * Decoder(maps), the incremental decoder. The data of a trace is fed
+ * to it as it is read, in chunks of any size, and result() returns
+ * the same tuple as decode() once it has all been read. A decoder is
+ * used by a single thread.
+ */
+typedef struct
+{
+    PyObject_HEAD
+    decoder_state_t *state;
+} decoder_t;
+
+static PyObject *
+decoder_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PyObject *maps;
+    if (!PyArg_ParseTuple(args, "O:Decoder", &maps))
+        return NULL;
+
+    decoder_t *self = PyObject_New(decoder_t, type);
+    if (self == NULL)
+        return NULL;
+    self->state = new decoder_state_t;
+    if (!decoder_init(self->state, maps))
+    {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+
+static void
+decoder_dealloc(decoder_t *self)
+{
+    if (self->state)
+        Py_XDECREF(self->state->maps);
+    delete self->state;
+    PyObject_Del(self);
+}
+
+static PyObject *
+decoder_feed_method(decoder_t *self, PyObject *args)
+{
+    const char *data;
+    Py_ssize_t size;
+    if (!PyArg_ParseTuple(args, "s#:feed", &data, &size))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    decoder_feed(self->state, (const uint8_t *)data, (size_t)size);
+    Py_END_ALLOW_THREADS
+    if (!self->state->ok)
+    {
+        PyErr_SetString(PyExc_ValueError, "malformed trace");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+decoder_result_method(decoder_t *self)
+{
+    return decoder_result(self->state);
+}
+
+static PyMethodDef decoder_methods[] = {
+    {"feed", (PyCFunction)decoder_feed_method, METH_VARARGS,
+        "feed(data) -> decodes the complete sections read so far"},
+    {"result", (PyCFunction)decoder_result_method, METH_NOARGS,
+        "result() -> (blocks, totals, counts, edges, crashed, rest)"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject DecoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "tracedecoder.Decoder",      /* tp_name */
+    sizeof(decoder_t),           /* tp_basicsize */
+    0,                           /* tp_itemsize */
+    (destructor)decoder_dealloc, /* tp_dealloc */
+};
+
+static PyMethodDef tracedecoder_methods[] = {
+    {"compile_blocks", compile_blocks, METH_VARARGS,
+        "compile_blocks(ranges) -> compiled map of (start, end) block ranges"},
+    {"decode", decode, METH_VARARGS,
+        "decode(data, maps) -> (blocks, totals, counts, edges, crashed, rest)"},
+    {NULL, NULL, 0, NULL}
+};
+
+PyMODINIT_FUNC
+inittracedecoder(void)
+{
+    DecoderType.tp_flags = Py_TPFLAGS_DEFAULT;
+    DecoderType.tp_doc = "Decoder(maps) -> incremental decoder of a trace";
+    DecoderType.tp_methods = decoder_methods;
+    DecoderType.tp_new = decoder_new;
+    if (PyType_Ready(&DecoderType) < 0)
+        return;
+
+    PyObject *module = Py_InitModule("tracedecoder", tracedecoder_methods);
+    if (module == NULL)
+        return;
+
+    Py_INCREF(&DecoderType);
+    PyModule_AddObject(module, "Decoder", (PyObject *)&DecoderType);
+}
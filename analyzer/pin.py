@@ -17,12 +17,106 @@ import subprocess
 import threading
 import ctypes
 import random
+import struct
+import select
+import errno
+import mmap
+import io
+import atexit
 
 EVENT_ALL_ACCESS = 0x1F0003
 EVENT_MODIFY_STATE = 0x0002
+CREATE_SUSPENDED = 0x4
 
 NMPWAIT_USE_DEFAULT_WAIT = 0x0
 NMPWAIT_WAIT_FOREVER = 0xFFFFFFFF
+# how long the pipe of a run is waited for at once, in milliseconds
+PIPE_WAIT_MS = 5
+
+class SharedMemory(object):
+    '''
+        A shared memory region that the coverage.so pintool writes its
+        trace into, when it runs with -shm. The region starts with a
+        header: [magic, 4 bytes][flags, 4 bytes][size, 8 bytes]
+        [used, 8 bytes], followed by `size' bytes of data. The data has
+        exactly the same format as the stream written to the FIFO.
+
+        On Linux the region is a file under /dev/shm, which is what
+        shm_open() creates. On Windows it is a named file mapping.
+    '''
+    HEADER = struct.Struct('<IIQQ')
+    SHM_MAGIC = 0x4d48535a
+    SHM_OVERFLOW = 0x1
+
+    name = None
+    size = None
+    region = None
+
+    def __init__(self, size, name=None):
+        if name == None:
+            name = 'choronzon-%d-%x' % (
+                    os.getpid(),
+                    random.randint(0, 0xFFFFFFFF)
+                    )
+        self.size = size
+        length = self.HEADER.size + size
+
+        if platform.system() == 'Linux':
+            self.name = os.path.join('/dev/shm', name)
+            fd = os.open(self.name, os.O_RDWR | os.O_CREAT | os.O_TRUNC,
+                    0600)
+            try:
+                os.ftruncate(fd, length)
+                self.region = mmap.mmap(fd, length)
+            finally:
+                os.close(fd)
+        elif platform.system() == 'Windows':
+            self.name = 'Local\\%s' % name
+            self.region = mmap.mmap(-1, length, tagname=self.name)
+
+        atexit.register(self.close)
+        self.reset()
+
+    def get_path(self):
+        '''
+            returns the name that the pintool must open.
+        '''
+        return self.name
+
+    def reset(self):
+        '''
+            empties the region before a new run.
+        '''
+        self.region[:self.HEADER.size] = self.HEADER.pack(
+                self.SHM_MAGIC, 0, self.size, 0)
+
+    def open(self):
+        '''
+            returns a file-like object with the data written by the last
+            run, so that it can be parsed like the FIFO.
+        '''
+        _, _, _, used = self.HEADER.unpack_from(self.region)
+        start = self.HEADER.size
+        return io.BytesIO(self.region[start:start + used])
+
+    def overflowed(self):
+        '''
+            returns True if the last run did not fit in the region, its
+            trace is then missing the sections that came last.
+        '''
+        _, flags, _, _ = self.HEADER.unpack_from(self.region)
+        return bool(flags & self.SHM_OVERFLOW)
+
+    def close(self):
+        '''
+            unmaps and removes the region.
+        '''
+        if self.region == None:
+            return
+        self.region.close()
+        self.region = None
+        if platform.system() == 'Linux' and os.path.exists(self.name):
+            os.unlink(self.name)
 
 class PinRunner(object):
     '''
@@ -37,6 +131,7 @@ class PinRunner(object):
     timeout = None
     event_name = None
     timer = None
+    cpu = None
 
     def __init__(self, timeout=20):
         self.timeout = timeout
@@ -77,6 +172,38 @@ class PinRunner(object):
         self.timer = threading.Timer(float(seconds), self.handler)
         self.timer.start()
 
+    def set_affinity(self, cpu):
+        '''
+            pins every following run to the given CPU, or lets it
+            float if cpu is None.
+        '''
+        self.cpu = cpu
+
+    def _creation_flags(self):
+        '''
+            On Windows pin.exe starts suspended when the run is pinned,
+            so that its affinity is set before it creates the target,
+            which inherits it, see _apply_affinity().
+        '''
+        if self.cpu == None or platform.system() != 'Windows':
+            return 0
+        return CREATE_SUSPENDED
+
+    def _apply_affinity(self):
+        '''
+            Sets the affinity of the suspended pin.exe and resumes it.
+            The handle of its thread is closed by subprocess, hence the
+            whole process is resumed.
+        '''
+        if self.cpu == None or platform.system() != 'Windows':
+            return
+        handle = int(self.process._handle)
+        try:
+            ctypes.windll.kernel32.SetProcessAffinityMask(
+                    handle, 1 << self.cpu)
+        finally:
+            ctypes.windll.ntdll.NtResumeProcess(handle)
+
     def craft_command(self, pintool, arguments=''):
         '''
             creates a command string based on the user settings,
@@ -95,6 +222,9 @@ class PinRunner(object):
             cmd = shlex.split(
                 self.cmd_template % (pintool, arguments)
                 )
+            # on Linux the affinity is inherited from taskset
+            if self.cpu != None:
+                cmd = ['taskset', '-c', '%d' % self.cpu] + cmd
         elif platform.system() == 'Windows':
             cmd = self.cmd_template % (pintool, arguments)
         return cmd
@@ -119,7 +249,9 @@ class PinRunner(object):
             with open(os.devnull, 'w') as nullfp:
                 print 'Calling: %s' % cmd
                 self.process = subprocess.Popen(cmd,
-                                    stdout=nullfp, stderr=nullfp)
+                                    stdout=nullfp, stderr=nullfp,
+                                    creationflags=self._creation_flags())
+                self._apply_affinity()
 
             ### self.process.wait()
 
@@ -132,14 +264,37 @@ class Coverage(PinRunner):
         used with the coverage.so pintool that accompanies Choronzon.
         It makes use of OS provided pipes and events to collect
         the execution information as quickly as possible.
+
+        `options' is a list of extra pintool arguments (e.g. '-dedup')
+        that are passed to every run. If `shared_memory' is the size of a
+        region in bytes, the trace is written to shared memory instead of
+        a FIFO, and the caller must wait() for the run before reading it.
     '''
+    options = None
+    shared = None
+
     def __init__(self,
             pintool='analyzer/coverage/obj-intel64/coverage.so',
-            timeout=20
+            timeout=20,
+            options=None,
+            shared_memory=0
             ):
         self.pintool = os.path.abspath(pintool)
+        if options == None:
+            options = []
+        self.options = list(options)
+        if shared_memory:
+            self.shared = SharedMemory(shared_memory)
+            self.options.append('-shm')
         super(Coverage, self).__init__(timeout)
 
+    def add_options(self, options):
+        '''
+            Appends extra pintool arguments, which are known only after
+            the analyzer has been created.
+        '''
+        self.options.extend(options)
+
     def _run(self, execmd, output, whitelist):
         '''
             execmd is the command string to run
@@ -152,12 +307,19 @@ class Coverage(PinRunner):
         for image in whitelist:
             quoted_whilelist.append('\"%s\"' % os.path.basename(image))
 
+        options = ' '.join(self.options)
+
         # print '[+] Running pintool...'
         if platform.system() == 'Linux':
             return super(Coverage, self).run(
                     self.pintool,
-                    '-o %s -wht %s -- %s'
-                    % (output, ' -wht '.join(quoted_whilelist), execmd)
+                    '-o %s %s -wht %s -- %s'
+                    % (
+                        output,
+                        options,
+                        ' -wht '.join(quoted_whilelist),
+                        execmd
+                        )
                     )
         elif platform.system() == 'Windows':
             self.event_name = 'Global\\event%s' % str(
@@ -165,10 +327,11 @@ class Coverage(PinRunner):
                     )
             return super(Coverage, self).run(
                     self.pintool,
-                    '-o %s -e %s -wht %s -- %s'
+                    '-o %s -e %s %s -wht %s -- %s'
                     % (
                         output,
                         self.event_name,
+                        options,
                         ' -wht '.join(quoted_whilelist),
                         execmd
                         )
@@ -179,15 +342,35 @@ class Coverage(PinRunner):
             os.mkfifo(output)
 
     def _post_run(self, output):
+        '''
+            On Windows, waits until the pintool has created the named pipe.
+            WaitNamedPipeA() fails at once while there is no pipe yet, so
+            it is retried after a while and only as long as pin runs.
+        '''
         if platform.system() == 'Windows':
-            ready = 0
-            while not ready:
-                ready = ctypes.windll.kernel32.WaitNamedPipeA(
-                        output,
-                        NMPWAIT_USE_DEFAULT_WAIT
-                    )
+            while not ctypes.windll.kernel32.WaitNamedPipeA(
+                    output, PIPE_WAIT_MS):
+                if self.process.poll() != None:
+                    raise IOError('pin exited before it opened %s' % output)
+                time.sleep(PIPE_WAIT_MS / 1000.0)
+
+    def wait(self):
+        '''
+            waits for the last run to finish and returns its exit code.
+        '''
+        if self.process == None:
+            return None
+        status = self.process.wait()
+        if self.timer != None:
+            self.timer.cancel()
+        return status
 
     def run(self, execmd, output='output.dmp', whitelist=[]):
+        if self.shared != None:
+            self.shared.reset()
+            self._run(execmd, self.shared.get_path(), whitelist)
+            return self.shared
+
         basename_output = output
         if platform.system() == 'Windows':
             output = '\\\\.\\pipe\\%s' % basename_output
@@ -197,3 +380,218 @@ class Coverage(PinRunner):
 
         return output
 
+class ForkServer(Coverage):
+    '''
+        Drives the coverage.so pintool in fork server mode (Linux only).
+        A single pin process is started, which stops the target at the
+        entry of the `entry' routine and forks a fresh child for every
+        test case. Since the command line is fixed for the lifetime of the
+        server, the input must always be written to the same file.
+        The control FIFOs are created next to the output FIFO and are named
+        after `control_name', which must differ between concurrent servers.
+    '''
+    entry = None
+    control = None
+    cmd_fd = None
+    status_fd = None
+    child = None
+    pending = None
+    base_options = None
+    control_name = 'forksrv'
+
+    FORKSRV_HELLO = 0x4e5a4843
+    POLL_INTERVAL = 0.05
+
+    def __init__(self,
+            pintool='analyzer/coverage/obj-intel64/coverage.so',
+            timeout=20,
+            options=None,
+            entry='main',
+            shared_memory=0
+            ):
+        if platform.system() != 'Linux':
+            raise OSError('The fork server is only supported on Linux.')
+        super(ForkServer, self).__init__(pintool, timeout, options,
+                shared_memory)
+        self.entry = entry
+        self.pending = False
+        self.base_options = self.options + ['-forksrv', entry]
+
+    def add_options(self, options):
+        '''
+            The options are added to the command line of the server,
+            they take effect the next time it starts.
+        '''
+        super(ForkServer, self).add_options(options)
+        self.base_options.extend(options)
+
+    def handler(self):
+        '''
+            the alarm handler kills the current child, not the
+            server itself.
+        '''
+        if self.child == None:
+            return
+        try:
+            os.kill(self.child, signal.SIGUSR2)
+        except OSError:
+            # the child has already exited
+            pass
+
+    def is_running(self):
+        '''
+            Returns True if the fork server process is alive.
+        '''
+        return self.process != None and self.process.poll() == None
+
+    def _read_status(self):
+        '''
+            reads a 4-byte status word from the server. Returns None if
+            the server died in the meantime.
+        '''
+        data = ''
+        while len(data) < 4:
+            ready, _, _ = select.select(
+                    [self.status_fd], [], [], self.POLL_INTERVAL)
+            if not ready:
+                if not self.is_running():
+                    return None
+                continue
+            chunk = os.read(self.status_fd, 4 - len(data))
+            if not chunk:
+                return None
+            data += chunk
+        return struct.unpack('<I', data)[0]
+
+    def _open_control(self):
+        '''
+            opens both control FIFOs without blocking forever, in case
+            the target exits before it reaches the entry routine.
+        '''
+        while self.cmd_fd == None:
+            try:
+                self.cmd_fd = os.open(self.control + '.cmd',
+                        os.O_WRONLY | os.O_NONBLOCK)
+            except OSError, ex:
+                if ex.errno != errno.ENXIO or not self.is_running():
+                    return False
+                time.sleep(self.POLL_INTERVAL)
+
+        self.status_fd = os.open(self.control + '.st',
+                os.O_RDONLY | os.O_NONBLOCK)
+        return self._read_status() == self.FORKSRV_HELLO
+
+    def start(self, execmd, whitelist):
+        '''
+            starts the fork server and waits until it is ready to fork.
+        '''
+        self.stop()
+        for name in (self.control + '.cmd', self.control + '.st'):
+            if os.path.exists(name):
+                os.unlink(name)
+            os.mkfifo(name)
+
+        self.options = self.base_options + ['-ctl', self.control]
+        self._run(execmd, self.control, whitelist)
+        # the server must not be killed by the alarm of the first run
+        if self.timer != None:
+            self.timer.cancel()
+
+        if not self._open_control():
+            self.stop()
+            raise IOError('The fork server did not reach "%s".' % self.entry)
+
+    def stop(self):
+        '''
+            terminates the fork server and removes the control FIFOs.
+        '''
+        for fd in (self.cmd_fd, self.status_fd):
+            if fd != None:
+                os.close(fd)
+        self.cmd_fd = self.status_fd = None
+        self.pending = False
+        self.child = None
+
+        if self.is_running():
+            self.process.kill()
+            self.process.wait()
+
+        if self.control != None:
+            for name in (self.control + '.cmd', self.control + '.st'):
+                if os.path.exists(name):
+                    os.unlink(name)
+
+    def wait(self):
+        '''
+            collects the wait status of the last child, if there
+            is one pending.
+        '''
+        if not self.pending:
+            return None
+        self.pending = False
+        status = self._read_status()
+        self.child = None
+        if self.timer != None:
+            self.timer.cancel()
+        return status
+
+    def _request(self, output):
+        '''
+            asks the server for a new child that writes to `output'.
+            Returns the pid of the child or None on failure.
+        '''
+        request = struct.pack('<I', len(output)) + output
+        try:
+            os.write(self.cmd_fd, request)
+        except OSError:
+            return None
+        return self._read_status()
+
+    def run(self, execmd, output='output.dmp', whitelist=[]):
+        self.wait()
+        self.control = os.path.join(os.path.dirname(output), self.control_name)
+        if not self.is_running():
+            self.start(execmd, whitelist)
+
+        if self.shared != None:
+            self.shared.reset()
+            output = self.shared.get_path()
+        else:
+            self._pre_run(output)
+        self.child = self._request(output)
+        if self.child == None:
+            # the server has died, restart it once.
+            self.start(execmd, whitelist)
+            self.child = self._request(output)
+            if self.child == None:
+                raise IOError('The fork server is not responding.')
+
+        self.pending = True
+        self.set_alarm(self.timeout)
+        if self.shared != None:
+            return self.shared
+        return output
+
+class PersistentServer(ForkServer):
+    '''
+        Drives the coverage.so pintool in persistent mode (Linux only).
+        The pintool runs the `entry' routine in a loop, once for every
+        test case, restoring the registers between iterations. It speaks
+        the same control protocol as the fork server, so only the pintool
+        options differ. After `iterations' test cases the target exits and
+        a new instance is started on the next run.
+    '''
+    def __init__(self,
+            pintool='analyzer/coverage/obj-intel64/coverage.so',
+            timeout=20,
+            options=None,
+            entry='main',
+            iterations=1000,
+            shared_memory=0
+            ):
+        super(PersistentServer, self).__init__(pintool, timeout, options,
+                entry, shared_memory)
+        self.base_options = self.options + [
+                '-persist', entry,
+                '-iters', '%d' % iterations
+                ]
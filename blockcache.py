@@ -13,6 +13,8 @@ class BlockCache(object):
     '''
     cache = None
     total = None
+    blocks = None
+    ids = None
 
 
     def __init__(self):
@@ -39,6 +41,7 @@ class BlockCache(object):
         '''
         if key == value[0]:
             self.total += 1
+            self.blocks = None
         self.cache[key] = value
 
     def get_bbl(self, bbl):
@@ -63,7 +66,10 @@ class BlockCache(object):
         if self.is_cached(bbl):
             return self.get_bbl(bbl)
 
-        bindex = self.cache.bisect(bbl)
+        # the last basic block that starts before bbl
+        bindex = self.cache.bisect(bbl) - 1
+        if bindex < 0:
+            return None
         bstart = self.cache.iloc[bindex]
         left, right = self.get_bbl(bstart)
         if left < bbl and right > bbl:
@@ -72,6 +78,43 @@ class BlockCache(object):
         else:
             return None
 
+    def get_ranges(self):
+        '''
+            Returns the (startEA, endEA) tuples of the basic blocks,
+            without the entries that get_cached() has added.
+        '''
+        return [value for key, value in self.cache.iteritems()
+                if key == value[0]]
+
+    def get_blocks(self):
+        '''
+            Returns the basic blocks sorted by their start. The index of
+            a basic block in this list is its id, which is the bit of the
+            block in a BlockSet.
+        '''
+        if self.blocks == None:
+            self.blocks = self.get_ranges()
+            self.ids = dict((bbl, bid) for bid, bbl in enumerate(self.blocks))
+        return self.blocks
+
+    def get_block_count(self):
+        return len(self.get_blocks())
+
+    def get_id(self, bbl):
+        '''
+            Returns the id of a basic block (tuple with (startEA, endEA)),
+            as returned by get_cached().
+        '''
+        self.get_blocks()
+        return self.ids[bbl]
+
+    def find_id(self, bbl):
+        '''
+            Same as get_id(), but returns None for unknown basic blocks.
+        '''
+        self.get_blocks()
+        return self.ids.get(bbl)
+
     @classmethod
     def parse_idmp(cls, idmp_iterable):
         '''
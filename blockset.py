@@ -0,0 +1,188 @@
+'''
+    blockset.py provides the sets of basic blocks of the traces. A set
+    is a dense bitset, where every bit is the id of an IDA basic block in
+    the BlockCache of the image, so the set operations of the evaluator
+    are word operations instead of tree walks.
+
+    The bitsets are the native ones of analyzer/decoder if they have been
+    built (with AVX2 kernels where available), or Python longs otherwise.
+'''
+
+import binascii
+
+try:
+    from analyzer.decoder import bitset
+except ImportError:
+    bitset = None
+
+# the BlockCache of every image, by image name. A BlockSet refers to its
+# cache by name only, since the traces are pickled with the chromosomes.
+caches = {}
+
+def register(image, cache):
+    '''
+        Registers the BlockCache of an image. The basic blocks of the
+        image must have been parsed already, their ids must not change.
+    '''
+    caches[image] = cache
+
+class LongBitset(object):
+    '''
+        Same as the native bitset.Bitset, on top of a Python long. Bits
+        are collected and or'ed in bulk, since every operation on a long
+        copies it.
+    '''
+    __slots__ = ('value', 'pending')
+
+    def __init__(self, nbits=0, value=0):
+        self.value = value
+        self.pending = []
+
+    def get(self):
+        if self.pending:
+            bits = bytearray((max(self.pending) >> 3) + 1)
+            for bit in self.pending:
+                bits[bit >> 3] |= 1 << (bit & 7)
+            bits.reverse()
+            self.value |= int(binascii.hexlify(bits), 16)
+            self.pending = []
+        return self.value
+
+    def add(self, bit):
+        self.pending.append(bit)
+
+    def discard(self, bit):
+        self.value = self.get() & ~(1 << bit)
+
+    def contains(self, bit):
+        return (self.get() >> bit) & 1 == 1
+
+    def count(self):
+        return bin(self.get()).count('1')
+
+    def copy(self):
+        return LongBitset(value=self.get())
+
+    def update(self, other):
+        self.value = self.get() | other.get()
+
+    def difference_update(self, other):
+        self.value = self.get() & ~other.get()
+
+    def difference(self, other):
+        return LongBitset(value=self.get() & ~other.get())
+
+    def difference_count(self, other):
+        return bin(self.get() & ~other.get()).count('1')
+
+    def intersection_count(self, other):
+        return bin(self.get() & other.get()).count('1')
+
+    def union_count(self, other):
+        return bin(self.get() | other.get()).count('1')
+
+    def indices(self):
+        bits = bin(self.get())[:1:-1]
+        return [i for i, bit in enumerate(bits) if bit == '1']
+
+    def tobytes(self):
+        value = self.get()
+        data = ('%x' % value) if value else ''
+        data = binascii.unhexlify(('0' * (len(data) & 1)) + data)
+        return data[::-1]
+
+    @classmethod
+    def frombytes(cls, data):
+        if not data:
+            return cls()
+        return cls(value=int(binascii.hexlify(data[::-1]), 16))
+
+if bitset != None:
+    Bitset = bitset.Bitset
+else:
+    Bitset = LongBitset
+
+class BlockSet(object):
+    '''
+        The set of the basic blocks of an image hit by a trace. Basic
+        blocks are the (startEA, endEA) tuples of the BlockCache, it
+        supports the part of the SortedSet interface used by Trace and
+        the evaluator.
+    '''
+    __slots__ = ('image', 'bits')
+
+    def __init__(self, image, bits=None):
+        self.image = image
+        if bits == None:
+            bits = Bitset(caches[image].get_block_count())
+        self.bits = bits
+
+    def add(self, bbl):
+        self.bits.add(caches[self.image].get_id(bbl))
+
+    def discard(self, bbl):
+        bid = caches[self.image].find_id(bbl)
+        if bid != None:
+            self.bits.discard(bid)
+
+    def update(self, other):
+        '''
+            In place union with either another BlockSet or an iterable
+            of basic blocks.
+        '''
+        if isinstance(other, BlockSet):
+            self.bits.update(other.bits)
+            return self
+        cache = caches[self.image]
+        for bbl in other:
+            self.bits.add(cache.get_id(bbl))
+        return self
+
+    def copy(self):
+        return BlockSet(self.image, self.bits.copy())
+
+    def difference_count(self, other):
+        '''
+            Returns len(self - other), without building the difference.
+        '''
+        return self.bits.difference_count(other.bits)
+
+    def intersection_count(self, other):
+        return self.bits.intersection_count(other.bits)
+
+    def union_count(self, other):
+        return self.bits.union_count(other.bits)
+
+    def __sub__(self, other):
+        return BlockSet(self.image, self.bits.difference(other.bits))
+
+    def __isub__(self, other):
+        self.bits.difference_update(other.bits)
+        return self
+
+    def __len__(self):
+        return self.bits.count()
+
+    def __contains__(self, bbl):
+        bid = caches[self.image].find_id(bbl)
+        return bid != None and self.bits.contains(bid)
+
+    def __iter__(self):
+        blocks = caches[self.image].get_blocks()
+        for bid in self.bits.indices():
+            yield blocks[bid]
+
+    def __getstate__(self):
+        return self.image, self.bits.tobytes()
+
+    def __setstate__(self, state):
+        self.image, data = state
+        self.bits = Bitset.frombytes(data)
+
+def difference_count(this, other):
+    '''
+        Returns len(this - other) for both BlockSet and SortedSet.
+    '''
+    if isinstance(this, BlockSet):
+        return this.difference_count(other)
+    return len(this - other)
@@ -6,6 +6,11 @@ import shutil
 import random
 import platform
 
+# the coverage of a chromosome in the shared directory, see virgin.pack()
+COVERAGE_SUFFIX = '.cov'
+# a file of the shared directory that is still being written
+PARTIAL_SUFFIX = '.part'
+
 class Singleton(type):
     '''
         Assing this class as the __metaclass__ member of a class and it will
@@ -37,7 +42,7 @@ class Campaign(object):
     def __init__(self, campaign_id=None, work_dir='.'):
         if self.campaign_id == None:
             self.files = []
-            self.shared_files = []
+            self.shared_files = set()
             self.chromo_files = {}
             self.work_dir = self.__checkfilename(work_dir)
             self.new_campaign(campaign_id)
@@ -159,7 +164,7 @@ class Campaign(object):
             with other Choronzon's instances. If the directory does not exist,
             it will create it.
         '''
-        self.shared_files = []
+        self.shared_files = set()
         if not os.path.exists(abspath):
             os.makedirs(abspath)
         self.shared_dir = abspath
@@ -240,7 +245,7 @@ class Campaign(object):
             does nothing.
         '''
         if not self.already_processed(filename):
-            self.shared_files.append(filename)
+            self.shared_files.add(filename)
             with open(os.path.join(self.shared_dir, filename), 'r') as fin:
                 with open(os.path.join(self.local_dir, filename), 'wb') as fout:
                     fout.write(fin.read())
@@ -255,17 +260,59 @@ class Campaign(object):
         '''
         return filename in self.shared_files
 
-    def dump_to_shared(self, filename, bytestring):
+    def skip_shared(self, filename):
+        '''
+            Marks a chromosome of the shared directory as processed without
+            copying it, e.g. because it brings no new coverage.
+        '''
+        self.shared_files.add(filename)
+
+    def read_shared_coverage(self, filename):
+        '''
+            Returns the coverage that was dumped along with a chromosome of
+            the shared directory, or None if there is none.
+        '''
+        try:
+            with open(os.path.join(self.shared_dir,
+                    filename + COVERAGE_SUFFIX), 'rb') as fin:
+                return fin.read()
+        except IOError:
+            return None
+
+    def list_shared(self):
+        '''
+            Returns the names of the chromosomes of the shared directory
+            that have not been processed yet.
+        '''
+        return [filename for filename in os.listdir(self.shared_dir)
+                if not filename.endswith(COVERAGE_SUFFIX) and
+                not filename.endswith(PARTIAL_SUFFIX) and
+                not self.already_processed(filename)]
+
+    def write_shared(self, filename, bytestring):
+        '''
+            Writes a file of the shared directory under a temporary name
+            first, so that the other instances never read a partial one.
+        '''
+        path = os.path.join(self.shared_dir, filename)
+        with open(path + PARTIAL_SUFFIX, 'wb') as fout:
+            fout.write(bytestring)
+        if platform.system() == 'Windows' and os.path.exists(path):
+            os.unlink(path)
+        os.rename(path + PARTIAL_SUFFIX, path)
+
+    def dump_to_shared(self, filename, bytestring, coverage=None):
         '''
             Dumps a bytestring into the shared directory and into a local
-            directory.
+            directory. The coverage of the chromosome, if given, is dumped
+            first, so that it is there once the chromosome is.
         '''
         if filename not in self.shared_files:
-            self.shared_files.append(filename)
-            path = os.path.join(self.shared_dir, filename)
+            self.shared_files.add(filename)
+            if coverage != None:
+                self.write_shared(filename + COVERAGE_SUFFIX, coverage)
+            self.write_shared(filename, bytestring)
             localpath = os.path.join(self.local_dir, filename)
-            with open(path, 'wb') as fout:
-                fout.write(bytestring)
             with open(localpath, 'wb') as fout:
                 fout.write(bytestring)
 
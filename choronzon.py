@@ -61,19 +61,33 @@ class Choronzon(object):
             This functions is looking for files in the shared directory. If a
             file has not already been processed, it uses it to build a new
             Chromosome and import it into the current population.
+
+            A chromosome that was dumped along with its coverage is only
+            imported if the coverage is new to the campaign, which is merged
+            into the virgin map right away. The others are never copied.
         '''
-        listed_files = os.listdir(self.sharedpath)
-
-        for curr in listed_files:
-            if not self.campaign.already_processed(curr):
-                abspath = self.campaign.copy_from_shared(curr)
-                # build an empty chromosome, which will be filled with the
-                # contents of the file from the shared directory
-                new_chromo = chromosome.Factory.build_empty()
-                new_chromo.load_chromosome(abspath)
-                self.population.add_chromosome(new_chromo)
-                # this is for updating the generation trace
-                self.population.add_trace(new_chromo.uid, new_chromo.trace)
+        skipped = 0
+        for curr in self.campaign.list_shared():
+            packed = self.campaign.read_shared_coverage(curr)
+            chunks = None
+            if packed != None:
+                chunks = self.tracer.virgin.unpack(packed)
+            if chunks != None and not self.tracer.virgin.merge(chunks):
+                self.campaign.skip_shared(curr)
+                skipped += 1
+                continue
+
+            abspath = self.campaign.copy_from_shared(curr)
+            # build an empty chromosome, which will be filled with the
+            # contents of the file from the shared directory
+            new_chromo = chromosome.Factory.build_empty()
+            new_chromo.load_chromosome(abspath)
+            self.population.add_chromosome(new_chromo)
+            # this is for updating the generation trace
+            self.population.add_trace(new_chromo.uid, new_chromo.trace)
+        if skipped:
+            self.campaign.log('Skipped %d shared chromosomes with no new '
+                    'coverage' % skipped)
 
     def fuzz(self):
         '''
@@ -163,6 +177,33 @@ class Choronzon(object):
             #else:
             #    self.strategy.bad(fuzzer)
 
+    def save_crash(self, chromo, trace):
+        '''
+            Saves the input that triggered a crash in the crashes directory.
+            If the pintool reported the faulting context, the file is named
+            after the crash id of the trace and only the first input of
+            every crash id is kept.
+        '''
+        crash_dir = self.campaign.create_directory('crashes')
+        crash_id = trace.get_crash_id()
+        if crash_id == None:
+            path = os.path.join(crash_dir, '%s' % chromo.uid)
+        else:
+            path = os.path.join(crash_dir, crash_id)
+            if os.path.exists(path):
+                self.campaign.log('Duplicate crash %s by %s.' % (
+                        crash_id, chromo.uid))
+                return
+
+        with open(path, 'wb') as fout:
+            fout.write(chromo.serialize())
+        self.campaign.log('CRASH! :)')
+        if crash_id != None:
+            signal, image, offset, fault, _, depth = trace.crash
+            self.campaign.log('Signal 0x%x at %s+0x%x, fault address 0x%x,'
+                    ' call depth %d.' % (signal, image, offset, fault, depth))
+        self.campaign.log('The trigger file is saved at %s.' % path)
+
     def analyze(self):
         '''
             Analyze the corpus of the current generation, by instrumenting the
@@ -174,26 +215,56 @@ class Choronzon(object):
                 len(self.population.current))
             )
         crashed_uids = []
+        discarded_uids = []
+        incomplete = 0
 
-        for chromo in self.population.get_all_from_current():
-            newfile = self.campaign.create(
+        # the chromosomes are analyzed by all the workers of the
+        # tracer at once, the results are processed in order.
+        chromosomes = list(self.population.get_all_from_current())
+        newfiles = []
+        for chromo in chromosomes:
+            newfiles.append(self.campaign.create(
                                     '%s' % chromo.uid,
                                     chromo.serialize()
-                                    )
-            self.campaign.log('Analyzing %s' % chromo.uid)
-            trace = self.tracer.analyze('%s' % chromo.uid)
+                                    ))
+        self.campaign.log('Analyzing %d chromosomes with %d workers' % (
+                len(chromosomes), len(self.tracer.analyzers))
+            )
+        traces = self.tracer.analyze_all(
+                ['%s' % chromo.uid for chromo in chromosomes])
+
+        for chromo, newfile, trace in zip(chromosomes, newfiles, traces):
             self.campaign.log('Analysis of %s finished' % chromo.uid)
 
+            # the comparisons of every trace, crashing or not, feed the
+            # input-to-state mutators
+            if trace.cmps:
+                self.strategy.learn(trace.cmps)
+
             # if the fuzzed file triggered a bug (yay!!), remove it from the
             # population, since it may trigger the same bug again and again
             if trace.has_crashed:
-                crash_dir = self.campaign.create_directory('crashes')
-                path = os.path.join(crash_dir, '%s' % chromo.uid)
-                with open(path, 'wb') as fout:
-                    fout.write(chromo.serialize())
-                self.campaign.log('CRASH! :)')
-                self.campaign.log('The trigger file is saved at %s.' % path)
                 crashed_uids.append(chromo.uid)
+                self.save_crash(chromo, trace)
+            elif not trace.is_complete:
+                # the trace lost its last sections, its fitness would
+                # be wrong, so it is neither evaluated nor kept.
+                incomplete += 1
+                discarded_uids.append(chromo.uid)
+                try:
+                    os.unlink(newfile)
+                except:
+                    pass
+            elif not trace.is_novel and chromo.fuzzer != None \
+                    and 'DiscardNonNovel' in self.configuration \
+                    and self.configuration['DiscardNonNovel']:
+                # nothing new, it is neither evaluated nor kept. The
+                # initial corpus is always kept.
+                discarded_uids.append(chromo.uid)
+                try:
+                    os.unlink(newfile)
+                except:
+                    pass
             else:
                 self.population.add_trace(chromo.uid, trace)
                 try:
@@ -207,6 +278,15 @@ class Choronzon(object):
         # generation. Otherwise, python will raise a RuntimeError expcetion.
         for uid in crashed_uids:
             self.population.delete_chromosome(uid)
+        for uid in discarded_uids:
+            self.population.delete_chromosome(uid)
+        if incomplete:
+            self.campaign.log('Discarded %d chromosomes with an incomplete '
+                    'trace, the shared memory region is too small' %
+                    incomplete)
+        if len(discarded_uids) > incomplete:
+            self.campaign.log('Discarded %d chromosomes with no new coverage' %
+                    (len(discarded_uids) - incomplete))
 
         if self.sharedpath != None:
             self._grab_from_shared()
@@ -236,7 +316,8 @@ class Choronzon(object):
                 filename = str(chromo.uid)
                 if not self.campaign.already_processed(filename):
                     self.campaign.dump_to_shared(filename,
-                                        chromo.dumps_chromosome())
+                                        chromo.dumps_chromosome(),
+                                        self.tracer.virgin.pack(chromo.trace))
 
         elite_dir = self.campaign.create_directory('%s' % self.population.epoch)
 
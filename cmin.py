@@ -0,0 +1,209 @@
+#!/usr/bin/env python
+'''
+    cmin.py minimizes a corpus, e.g. the initial population or the crashes
+    directory of a campaign. Every file of the input directory runs once
+    under the coverage pintool, with the analyzer, the workers and the
+    options of the configuration (so in fork server mode, in parallel, if
+    it says so), and only the coverage of the runs is kept in memory.
+
+    The features of a run are its basic blocks, the hit count buckets of
+    its blocks and the buckets of its edges, along with its crash id. The
+    files that are kept cover all the features of the corpus, picked
+    greedily by the features they add per cost, where the cost of a file
+    is its size, its execution time or both.
+'''
+
+import os
+import sys
+import heapq
+import shutil
+import argparse
+
+import configuration
+import blockset
+import tracer
+
+# the runs of a batch are analyzed at once, their traces are dropped after
+BATCH_SIZE = 64
+
+class Corpus(object):
+    '''
+        The files of the corpus along with the ids of their features, which
+        are numbered in the order they are first seen.
+    '''
+    paths = None
+    features = None
+    costs = None
+    ids = None
+
+    def __init__(self):
+        self.paths = []
+        self.features = []
+        self.costs = []
+        self.ids = {}
+
+    def feature_id(self, feature):
+        return self.ids.setdefault(feature, len(self.ids))
+
+    def add(self, path, trace, cost):
+        '''
+            Adds a file along with the features of its trace.
+        '''
+        features = set()
+        for img in trace.images:
+            bbls = trace.set_per_image[img]
+            if isinstance(bbls, blockset.BlockSet):
+                for bid in bbls.bits.indices():
+                    features.add(self.feature_id((img, bid)))
+            else:
+                for bbl in bbls:
+                    features.add(self.feature_id((img, bbl)))
+
+            # every bucket of a block is a feature of its own
+            for bbl, mask in trace.counts_per_image[img].iteritems():
+                while mask:
+                    bucket = mask & -mask
+                    mask ^= bucket
+                    features.add(self.feature_id((img, bbl, bucket)))
+
+        for edge, bucket in trace.edges:
+            features.add(self.feature_id(('edge', edge, bucket)))
+        if trace.has_crashed:
+            features.add(self.feature_id(('crash', trace.get_crash_id())))
+
+        self.paths.append(path)
+        self.features.append(frozenset(features))
+        self.costs.append(cost)
+
+    def minimize(self):
+        '''
+            Returns the indices of a covering set of the files, the greedy
+            one. The gain of a file only decreases while files are picked,
+            so its gain is only computed again once it comes on top. The
+            files that the others cover are dropped at the end.
+        '''
+        uncovered = set(self.ids.itervalues())
+        heap = [(-len(features) / cost, index)
+                for index, (features, cost) in
+                enumerate(zip(self.features, self.costs)) if features]
+        heapq.heapify(heap)
+
+        kept = []
+        while heap and uncovered:
+            _, index = heapq.heappop(heap)
+            gain = len(self.features[index] & uncovered)
+            if not gain:
+                continue
+            score = -gain / self.costs[index]
+            if heap and score > heap[0][0]:
+                heapq.heappush(heap, (score, index))
+                continue
+            kept.append(index)
+            uncovered -= self.features[index]
+
+        # a file picked early may be covered by the later ones, the
+        # costly ones go first
+        counts = {}
+        for index in kept:
+            for feature in self.features[index]:
+                counts[feature] = counts.get(feature, 0) + 1
+        minimal = []
+        for index in sorted(kept, key=lambda index: -self.costs[index]):
+            features = self.features[index]
+            if all(counts[feature] > 1 for feature in features):
+                for feature in features:
+                    counts[feature] -= 1
+                continue
+            minimal.append(index)
+        return minimal
+
+def cost_of(path, trace, weight):
+    size = max(os.path.getsize(path), 1)
+    elapsed = max(trace.stats.get('wall_us', 0), 1)
+    if weight == 'size':
+        return float(size)
+    if weight == 'time':
+        return float(elapsed)
+    return float(size) * elapsed
+
+def main(args):
+    print '[+] Choronzon corpus minimization'
+    configuration.Configuration(args.config)
+    trace_tool = tracer.Tracer()
+    campaign = trace_tool.campaign
+
+    paths = sorted(os.path.join(args.input, name)
+            for name in os.listdir(args.input)
+            if os.path.isfile(os.path.join(args.input, name)))
+    print '[+] Tracing %d files with %d workers...' % (
+            len(paths), len(trace_tool.analyzers))
+
+    corpus = Corpus()
+    incomplete = []
+    for start in xrange(0, len(paths), BATCH_SIZE):
+        batch = paths[start:start + BATCH_SIZE]
+        seedids = []
+        for number, path in enumerate(batch):
+            seedid = 'cmin%d' % (start + number)
+            with open(path, 'rb') as fin:
+                campaign.create(seedid, fin.read())
+            seedids.append(seedid)
+
+        # the corpus must not count as coverage of the campaign, or
+        # the inputs it finds later would be dropped as known.
+        traces = trace_tool.analyze_all(seedids, novelty=False)
+        for path, seedid, trace in zip(batch, seedids, traces):
+            if trace.is_complete:
+                corpus.add(path, trace, cost_of(path, trace, args.weight))
+            else:
+                # its features are unknown, it is kept as it is
+                incomplete.append(path)
+            try:
+                os.unlink(campaign.get(seedid))
+            except OSError:
+                pass
+        print '[+] %d/%d files traced, %d features' % (
+                start + len(batch), len(paths), len(corpus.ids))
+
+    kept = [corpus.paths[index] for index in sorted(corpus.minimize())]
+    if incomplete:
+        print '[!] %d files have an incomplete trace and are kept' % (
+                len(incomplete))
+        kept.extend(incomplete)
+    size = sum(os.path.getsize(path) for path in paths)
+    kept_size = sum(os.path.getsize(path) for path in kept)
+    print '[+] %d of %d files cover all %d features (%d of %d bytes)' % (
+            len(kept), len(paths), len(corpus.ids), kept_size, size)
+    campaign.log('Corpus minimization of %s kept %d of %d files' % (
+            args.input, len(kept), len(paths)))
+
+    if not os.path.exists(args.output):
+        os.makedirs(args.output)
+    for path in kept:
+        shutil.copy(path, args.output)
+    return 0
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+            description='Minimizes a corpus by the coverage of its files'
+            )
+    parser.add_argument(
+            'config',
+            help='/path/to/config/file.py'
+            )
+    parser.add_argument(
+            'input',
+            help='the directory of the corpus'
+            )
+    parser.add_argument(
+            'output',
+            help='the directory the files that are kept are copied to'
+            )
+    parser.add_argument(
+            '--weight',
+            choices=('size', 'time', 'both'),
+            default='both',
+            help='the cost of a file, its size, its execution time or both'
+            )
+    arguments = parser.parse_args()
+    sys.exit(main(arguments))
@@ -94,6 +94,12 @@ class IDADisassembler(Disassembler):
 
         proc.wait()
 
+    def get_dump_path(self, blob, output='.'):
+        '''
+            returns the path of the .idmp dump of the binary.
+        '''
+        return os.path.join(output, '%s.idmp' % blob)
+
     def disassemble(self, blob, output='.'):
         '''
             wrapper that calls the appropriate functions in
@@ -101,7 +107,7 @@ class IDADisassembler(Disassembler):
         '''
         self._run_ida(blob, 'disassembler/prepare.py', output)
 
-        dump = os.path.join(output, '%s.idmp' % blob)
+        dump = self.get_dump_path(blob, output)
 
         with open(dump, 'r') as fin:
             for line in fin:
@@ -4,8 +4,6 @@
     for metric normalization and fitness calculation.
 '''
 
-import sortedcontainers as sc
-
 import configuration
 import campaign
 
@@ -77,6 +75,10 @@ class UniversalPathUniqueness(Metric):
         # holds the unique basic blocks per image (key)
         unique = {}
 
+        # the blocks hit by the other chromosomes of my generation are
+        # the ones that are hit more than once, once I am counted
+        counted = self.chromo.uid in this.covered
+
         # if other != None, means that this isn't the first generation
         if other != None:
             # unique will hold all the bbls that was hit in this chromo
@@ -89,9 +91,14 @@ class UniversalPathUniqueness(Metric):
             # if this is the first generation, unique corresponds to
             # all the bbls of the trace
             for img in self.chromo.trace.images:
-                unique[img] = sc.SortedSet().update(
-                        self.chromo.trace.set_per_image[img]
-                        )
+                unique[img] = self.chromo.trace.set_per_image[img]
+
+        if counted:
+            faults = this.refs.get_unique_total(unique.iteritems())
+            return faults / float(self.chromo.trace.get_unique_total())
+
+        for img in unique:
+            unique[img] = unique[img].copy()
         # iterate through all chromos in this generation (unless myself)
         for chromo in this:
             if chromo.uid == self.chromo.uid:
@@ -127,18 +134,61 @@ class GenerationUniqueness(Metric):
         if other == None:
             return 1.0
 
-        unique = {}
+        faults = self.chromo.trace.get_difference_total(other.trace)
 
-        for img, uniq in self.chromo.trace.get_difference_per_image(
-                other.trace
-                ):
-            unique[img] = uniq
+        return faults / float(self.chromo.trace.get_unique_total())
 
-        faults = 0x0
-        for img in unique:
-            faults += len(unique[img])
+class EdgeUniqueness(Metric):
+    '''
+        Returns the percentage of the edges of the trace of the given
+        chromosome that was not hit by any other chromosome in the other
+        generation. Unlike GenerationUniqueness, it tells apart inputs that
+        reach the same basic blocks through different paths. It requires
+        the EdgeCoverage setting.
+    '''
+    def get_normal(self, **kwargs):
+        other = kwargs['previous']
 
-        return faults / float(self.chromo.trace.get_unique_total())
+        if kwargs['previous'] != None:
+            if self.chromo in kwargs['previous']:
+                other = kwargs['current']
+
+        # if other == None, this is the first generation
+        if other == None:
+            return 1.0
+
+        if len(self.chromo.trace.edges) == 0x0:
+            return 0.0
+
+        faults = len(self.chromo.trace.get_edge_difference(other.trace))
+
+        return faults / float(len(self.chromo.trace.edges))
+
+class HitCountUniqueness(Metric):
+    '''
+        Returns the percentage of the basic blocks of the trace of the given
+        chromosome that was not hit the same number of times (in terms of
+        hit count buckets) by any other chromosome in the other generation.
+        It requires the HitCounts setting.
+    '''
+    def get_normal(self, **kwargs):
+        other = kwargs['previous']
+
+        if kwargs['previous'] != None:
+            if self.chromo in kwargs['previous']:
+                other = kwargs['current']
+
+        # if other == None, this is the first generation
+        if other == None:
+            return 1.0
+
+        total = self.chromo.trace.get_count_total()
+        if total == 0x0:
+            return 0.0
+
+        faults = len(self.chromo.trace.get_count_difference(other.trace))
+
+        return faults / float(total)
 
 class CodeCommonality(Metric):
     '''
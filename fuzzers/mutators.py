@@ -8,6 +8,9 @@
 '''
 import random
 import re
+import collections
+
+import traceformat
 
 class Mutator(object):
     '''
@@ -520,3 +523,58 @@ class NullMutator(Mutator):
     '''
     def __init__(self):
         super(NullMutator, self).__init__()
+
+
+class InputToStateMutator(Mutator):
+    '''
+        Finds one operand of a comparison of the target in the bytestring
+        and replaces it with the other one, like the input-to-state
+        replacement of CmpLog. The operands are learned from the traces,
+        so the CmpLog setting must be enabled. The operands of the
+        instructions are tried in both byte orders.
+    '''
+    MAX_PAIRS = 0x1000
+    SAMPLE = 0x100
+
+    pairs = None
+
+    def __init__(self):
+        super(InputToStateMutator, self).__init__()
+        self.pairs = collections.deque(maxlen=self.MAX_PAIRS)
+
+    def learn(self, cmps):
+        for kind, a, b in cmps:
+            # nothing to look for, e.g. the zeros of a cmp
+            if a.strip('\x00') == '' or b.strip('\x00') == '':
+                continue
+            self.pairs.append((a, b))
+            self.pairs.append((b, a))
+            if kind == traceformat.CMP_INS:
+                self.pairs.append((a[::-1], b[::-1]))
+                self.pairs.append((b[::-1], a[::-1]))
+
+    def mutate(self, data, howmany=1):
+        if not self.pairs:
+            return data
+
+        # every pair that is scanned for costs a pass over the data
+        pairs = random.sample(self.pairs, min(self.SAMPLE, len(self.pairs)))
+        found = []
+        for pattern, replacement in pairs:
+            index = data.find(pattern)
+            while index != -1:
+                found.append((index, pattern, replacement))
+                index = data.find(pattern, index + 1)
+        if not found:
+            return data
+
+        for _ in xrange(howmany):
+            index, pattern, replacement = random.choice(found)
+            if data[index:index + len(pattern)] != pattern:
+                continue
+            data = '%s%s%s' % (
+                    data[:index],
+                    replacement,
+                    data[index + len(pattern):]
+                )
+        return data
@@ -128,6 +128,15 @@ class FuzzingStrategy(object):
         if self.candidates[cid]['score'] > 1:
             self.candidates[cid]['score'] -= score
 
+    def learn(self, cmps):
+        '''
+            Passes the operands of the comparisons of a trace to the
+            mutators that make use of them.
+        '''
+        for mutator in self.mutators.itervalues():
+            if hasattr(mutator, 'learn'):
+                mutator.learn(cmps)
+
     def select_candidate(self):
         return Lottery.run(self.candidates.values())
 
@@ -47,6 +47,8 @@ Mutators = (
     'PurgeMutator',
     'SwapWord',
     'SwapDword',
+    # only along with CmpLog, see below
+    # 'InputToStateMutator',
     )
 
 # If KeepGenerations is True the seedfiles of each generation will be stored
@@ -67,3 +69,89 @@ Command = '\"C:\\Program Files\\IrfanView\\i_view64.exe\" %s'
 # stats to calculate the fitness. Full path of the modules is required.
 # Please note, that Whitelist must be a tuple even there is only one module.
 Whitelist = ('C:\\Program Files\\IrfanView\\i_view64.exe',)
+
+# If Deduplicate is True the pintool records every basic block only once and
+# writes just the unique offsets when the target exits. This greatly reduces
+# the data sent over the pipe, but the total number of executed basic blocks
+# is no longer known, so CodeCommonality degrades to a constant.
+Deduplicate = False
+
+# If FirstHitOnly is True, on top of Deduplicate, the instrumentation of every
+# basic block is removed after its first hit, so hot loops run at almost native
+# speed. It has no effect along with EdgeCoverage or the persistent mode.
+FirstHitOnly = False
+
+# If EdgeCoverage is True the pintool also records the hashed pairs of
+# consecutive basic blocks (edges) along with a bucketed hit count, like AFL.
+# Add 'EdgeUniqueness' to the FitnessAlgorithms to make use of them.
+EdgeCoverage = False
+
+# If HitCounts is True, on top of Deduplicate, the pintool counts the hits of
+# every basic block and reports them bucketed, like the edges, so loops that
+# run a different number of times are told apart. The total of a trace, used
+# by CodeCommonality, becomes the sum of the buckets. Add 'HitCountUniqueness'
+# to the FitnessAlgorithms to make use of them.
+HitCounts = False
+
+# If DiscardNonNovel is True, the fuzzed chromosomes whose trace hit nothing new
+# (basic blocks, hit count buckets or edges) in the whole campaign are dropped
+# before the evaluation. The coverage of the campaign is kept in virgin.map, in
+# the campaign directory.
+DiscardNonNovel = False
+
+# If StackHash is True the pintool keeps a shadow call stack of the whitelisted
+# images, so that the crashes are told apart by the hash of their call stack
+# too, and not only by the faulting instruction. Only the first input of every
+# crash is saved in the crashes directory.
+StackHash = False
+
+# If CmpLog is True the pintool records the operands of the comparisons of the
+# whitelisted images (CMP, TEST and SUB instructions and the calls of memcmp(),
+# strcmp() and friends), which are used by the InputToStateMutator to put the
+# values the target compares against into the chromosomes. The mutator must be
+# listed in Mutators as well, it is not used otherwise; without CmpLog it leaves
+# the chromosomes unchanged.
+CmpLog = False
+
+# If TraceBatching is True the pintool writes a single record per executed Pin
+# trace instead of one per basic block, and the blocks are resolved from a
+# table at the end of the trace. It has no effect along with Deduplicate.
+TraceBatching = False
+
+# If AsyncBuffers is set the pintool writes the trace from a thread of its own,
+# with this many spare buffers of AsyncBufferSize bytes, so that the target only
+# waits for the tracer once all of them are full. It is ignored by the fork
+# server, whose children would not inherit the thread.
+AsyncBuffers = 0
+AsyncBufferSize = 1024 * 1024
+
+# If MapBlocksInPintool is True the pintool loads the IDA dumps of the
+# whitelisted images and reports IDA basic blocks instead of Pin basic blocks,
+# so there is no translation left for the tracer to do.
+MapBlocksInPintool = False
+
+# If TraceCache is True the pintool keeps how the basic blocks of the
+# whitelisted images resolve (to an IDA block, to none, or filtered out) in a
+# .tcache file per image in the campaign directory, so the following runs skip
+# that work and only parse the IDA dumps once they compile a trace that no run
+# has seen before. A rebuilt image starts a new cache.
+TraceCache = False
+
+# InstrumentRanges and InstrumentFunctions restrict the instrumentation of the
+# whitelisted images to the given (image, start, end) offsets and (image,
+# function) pairs, e.g. to the decoding routines only. The functions are looked
+# up in the IDA dump along with MapBlocksInPintool, or else in the symbols of
+# the image. An image that is not listed is instrumented as a whole.
+# InstrumentRanges = (('i_view64.exe', 0x1000, 0x2000),)
+# InstrumentFunctions = (('i_view64.exe', 'ReadPNG'),)
+
+# Workers is the number of pintool instances that analyze the chromosomes of a
+# generation concurrently. If CpuAffinity is True, every instance is pinned to
+# its own CPU.
+Workers = 1
+CpuAffinity = False
+
+# If SharedMemory is set to a size in bytes, the pintool writes the trace into
+# a shared memory region of that size instead of a named pipe. Runs that do not
+# fit are reported as incomplete, so it works best along with Deduplicate.
+# SharedMemory = 64 * 1024 * 1024
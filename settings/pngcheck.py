@@ -54,5 +54,23 @@ KeepGenerations = True
 # Pintool related settings
 Timeout = 10
 
+# Uncomment to let the pintool end slow runs by itself, after the given number
+# of milliseconds (of CPU time if PintoolCpuTime is True) or after about the
+# given number of basic blocks. Timeout still applies as a last resort.
+# PintoolTimeout = 500
+# PintoolCpuTime = False
+# BasicBlockLimit = 50000000
+
+# Uncomment to run the target under a fork server that stops at the entry
+# of the given routine and forks a fresh child for every test case (Linux
+# only). The exported symbol must be visible to Pin.
+# ForkServer = 'main'
+
+# Uncomment to run the given routine of the target in a loop, once for every
+# test case, without restarting the process (Linux only). The routine must
+# read the input file itself and must not keep state between iterations.
+# Persistent = 'process_file'
+# PersistentIterations = 1000
+
 Command = '/usr/bin/pngcheck %s'
 Whitelist = ('/usr/bin/pngcheck',)
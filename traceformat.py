@@ -0,0 +1,149 @@
+#!/usr/bin/env python
+
+'''
+    Reader of the trace format v2, which is written by the coverage
+    pintool.
+
+    The trace starts with the following header:
+    [magic,             4 bytes]
+    [version,           2 bytes]
+    [flags,             2 bytes]
+    [number of images,  2 bytes]
+    IMAGE SECTION
+    [
+       [image name length,  2 bytes]
+       [image name, variable length]
+       ...
+    ]
+
+    and continues with sections of the following form, until EOF.
+    [section type,      1 byte ]
+    [payload length,    4 bytes]
+    [payload, variable length  ]
+
+    All the values of a payload are unsigned LEB128 varints, unless
+    noted otherwise. Unknown sections are skipped.
+'''
+
+import struct
+
+TRACE_MAGIC = 0x5a485443
+TRACE_VERSION = 2
+
+# the offsets are the starts of the IDA basic blocks, unless the image
+# had no .idmp dump; they can be looked up in the BlockCache directly
+TRACE_FLAG_IDA = 0x1
+
+# [image number][offset deltas...], the offsets are sorted and unique
+SEC_BLOCKS = 1
+# [thread id, 4 bytes][(image number, zigzag offset delta)...]
+SEC_RAW = 2
+# [(edge index delta, hit count bucket)...]
+SEC_EDGES = 3
+# [thread id, 4 bytes][signal or exception, 0xC on timeout]
+SEC_EVENT = 4
+# [thread id, 4 bytes][(trace id << 16 | executed blocks)...]
+SEC_TRACES = 5
+# [id of first entry][(image number, block count, zigzag offset deltas...)...],
+# an offset of TRACE_SKIP is a block that is filtered out or is not part of
+# an IDA basic block
+SEC_TRACE_TABLE = 6
+TRACE_SKIP = 0xFFFFFFFF
+# [image number][(offset delta, hit count bucket)...], same as SEC_BLOCKS
+SEC_COUNTS = 7
+# [thread id, 4 bytes][signal or exception][image number + 1, 0 if the image
+# is not whitelisted][pc offset][fault address][stack hash][stack depth]
+# [name length][basename of the image, if it is not whitelisted]
+SEC_CRASH = 8
+# [(site, kind, pair count, (length, bytes of both operands)...)...], the site
+# is image number << 32 | offset of the comparison, or of the return address
+# of the call for the routines of the memcmp() family
+SEC_CMPS = 9
+
+# [the counters of STATS, in order], the trailer of the trace
+SEC_STATS = 10
+
+# the counters of SEC_STATS: traces compiled by Pin, traces of the whitelisted
+# images, microseconds spent instrumenting, writes and bytes written to the
+# output, microseconds spent blocked in the writes, threads started
+STATS = ('traces', 'instrumented', 'jit_us', 'writes', 'bytes', 'blocked_us',
+        'threads')
+
+# kinds of SEC_CMPS entries
+CMP_INS = 1
+CMP_RTN = 2
+
+HEADER = struct.Struct('<IHHH')
+SECTION = struct.Struct('<BI')
+
+class TraceFormatError(Exception):
+    pass
+
+def read_header(fin):
+    '''
+        Reads the header of the trace and returns its flags along
+        with the list of image names.
+    '''
+    buf = fin.read(HEADER.size)
+    if len(buf) != HEADER.size:
+        raise TraceFormatError('truncated header')
+    magic, version, flags, nimg = HEADER.unpack(buf)
+    if magic != TRACE_MAGIC or version != TRACE_VERSION:
+        raise TraceFormatError('unsupported trace (version %d)' % version)
+
+    images = []
+    for _ in xrange(nimg):
+        imgname_sz, = struct.unpack('<H', fin.read(2))
+        images.append(fin.read(imgname_sz))
+    return flags, images
+
+def read_sections(fin):
+    '''
+        Yields the (type, payload) tuples of the sections until EOF.
+        A truncated section at the end of the trace is dropped.
+    '''
+    while True:
+        buf = fin.read(SECTION.size)
+        if len(buf) != SECTION.size:
+            return
+        stype, length = SECTION.unpack(buf)
+        payload = fin.read(length)
+        if len(payload) != length:
+            return
+        yield stype, payload
+
+def thread_id(payload):
+    return struct.unpack_from('<I', payload)[0]
+
+def varints(payload, pos=0):
+    '''
+        Yields the varints of the payload, starting at pos.
+    '''
+    end = len(payload)
+    while pos < end:
+        value = shift = 0
+        while True:
+            byte = ord(payload[pos])
+            pos += 1
+            value |= (byte & 0x7f) << shift
+            if byte < 0x80:
+                break
+            shift += 7
+        yield value
+
+def read_varint(payload, pos):
+    '''
+        Returns the varint at pos and the position that follows it,
+        for payloads that mix varints with raw bytes.
+    '''
+    value = shift = 0
+    while True:
+        byte = ord(payload[pos])
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        if byte < 0x80:
+            return value, pos
+        shift += 7
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
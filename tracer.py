@@ -1,7 +1,12 @@
 #!/usr/bin/env python
 
 import os
-import struct
+import io
+import time
+import shutil
+import threading
+import multiprocessing
+import Queue
 import sortedcontainers as sc
 import settings
 
@@ -10,22 +15,44 @@ import disassembler
 import analyzer
 import configuration
 import blockcache as bcache
+import blockset
+import traceformat
+import virgin
+
+try:
+    from analyzer.decoder import tracedecoder
+except ImportError:
+    tracedecoder = None
+
+# the most that the native decoder is fed at once
+READ_SIZE = 1 << 20
 
 class Trace(object):
     images = None
     # bbls_per_image = None
     set_per_image = None
+    counts_per_image = None
+    edges = None
     functions = None
     trace = None
     total = None
     has_crashed = None
+    crash = None
+    cmps = None
+    stats = None
+    is_novel = None
+    is_complete = None
 
     def __init__(self):
         self.has_crashed = False
+        self.is_complete = True
         self.images = []
         self.total = 0x0
         #self.bbls_per_image = {}
         self.set_per_image = {}
+        self.counts_per_image = {}
+        self.edges = sc.SortedSet()
+        self.stats = {}
 
     def add_image(self, image):
         '''
@@ -33,22 +60,118 @@ class Trace(object):
         '''
         self.images.append(image)
         #self.bbls_per_image[image] = []
-        self.set_per_image[image] = sc.SortedSet()
+        if image in blockset.caches:
+            self.set_per_image[image] = blockset.BlockSet(image)
+        else:
+            self.set_per_image[image] = sc.SortedSet()
+        self.counts_per_image[image] = {}
 
-    def add_bbl(self, image, bbl):
+    def add_bbl(self, image, bbl, count=None):
         '''
-            Adds a new basic block into the trace.
+            Adds a new basic block into the trace. If count is given, it
+            is the hit count bucket of the block reported by the pintool
+            and it also counts towards the total. The buckets of a block
+            are kept as a bitmask.
         '''
         # The bbl given as input in this function is
         # taken from the block cache. Technically, this means
         # that it corresponds to the basic blocks of IDA.
         #self.bbls_per_image[image].append(bbl)
         self.set_per_image[image].add(bbl)
-        self.total += 1
+        if count == None:
+            self.total += 1
+            return
+        # the buckets are powers of two, so the buckets of all the Pin
+        # blocks of the IDA block, or of all the merged traces, are kept.
+        counts = self.counts_per_image[image]
+        counts[bbl] = counts.get(bbl, 0) | count
+        self.total += count
+
+    def set_crash(self, signal, image, offset, fault, stack, depth):
+        '''
+            Sets the faulting context reported by the pintool: the signal
+            (or exception), the faulting pc as image name and offset, the
+            faulting address (0 if unknown) and the hash and depth of the
+            call stack.
+        '''
+        self.has_crashed = True
+        if self.crash == None:
+            self.crash = (signal, image, offset, fault, stack, depth)
+
+    def get_crash_id(self):
+        '''
+            Returns a string that identifies the crash of the trace, out of
+            the signal, the faulting pc and the call stack hash. Inputs that
+            crash with the same id are most likely the same bug. It returns
+            None if the pintool did not report the faulting context.
+        '''
+        if self.crash == None:
+            return None
+        signal, image, offset, _, stack, _ = self.crash
+        return '%x_%s+%x_%08x' % (signal, image, offset, stack)
+
+    def add_cmp(self, kind, a, b):
+        '''
+            Adds the operands of a comparison of the target, as reported
+            by the pintool with -cmplog: either an instruction (CMP_INS)
+            with operands of 2 to 8 bytes, little endian, or a routine of
+            the memcmp() family (CMP_RTN) with its buffers.
+        '''
+        if self.cmps == None:
+            self.cmps = []
+        self.cmps.append((kind, a, b))
+
+    def __getstate__(self):
+        # the operands are consumed once by the mutators, there is no
+        # need to keep them along with the chromosome.
+        state = self.__dict__.copy()
+        state.pop('cmps', None)
+        return state
+
+    def add_edge(self, edge, bucket):
+        '''
+            Adds a new edge into the trace. An edge is the
+            (edge index, hit count bucket) tuple reported by the
+            pintool, so that the same edge hit a different number of
+            times counts as a different edge.
+        '''
+        self.edges.add((edge, bucket))
+
+    def get_edge_difference(self, trace):
+        '''
+            Returns the edges of this trace that do not exist in the
+            trace object given as argument.
+        '''
+        return self.edges - trace.edges
+
+    def get_count_difference(self, trace):
+        '''
+            Returns the (image, bbl, hit count bucket) tuples of this
+            trace that do not exist in the trace object given as argument.
+            A block that was hit a different number of times, e.g. by
+            a different number of loop iterations, is different.
+        '''
+        faults = []
+        for img in self.images:
+            other = trace.counts_per_image.get(img, {})
+            for bbl, count in self.counts_per_image[img].iteritems():
+                if count & ~other.get(bbl, 0):
+                    faults.append((img, bbl, count))
+        return faults
+
+    def get_count_total(self):
+        '''
+            Returns the number of basic blocks with a hit count bucket.
+        '''
+        count = 0x0
+        for img in self.counts_per_image:
+            count += len(self.counts_per_image[img])
+        return count
 
     def get_total(self):
         '''
-            Returns the total number of basic blocks in the trace.
+            Returns the total number of basic blocks in the trace. With
+            hit counts, it is the sum of the hit count buckets.
         '''
         return self.total
 
@@ -62,6 +185,18 @@ class Trace(object):
             count += len(self.set_per_image[img])
         return count
 
+    def get_difference_total(self, trace):
+        '''
+            Returns the number of basic blocks of this trace that do not
+            exist in the trace object given as argument, without building
+            the differences.
+        '''
+        count = 0x0
+        for img in self.images:
+            count += blockset.difference_count(self.set_per_image[img],
+                    trace.set_per_image[img])
+        return count
+
     def get_difference_per_image(self, trace):
         '''
             This function yields a tuple with the image name
@@ -81,11 +216,7 @@ class Trace(object):
             if it is 0.0, the traces have not any common basic block.
         '''
         assert len(self.set_per_image) == len(trace.set_per_image)
-        faults = 0x0
-        for img in self.images:
-            this = self.set_per_image[img]
-            other = trace.set_per_image[img]
-            faults += len(this - other)
+        faults = self.get_difference_total(trace)
         return faults / float(self.get_unique_total())
 
     def update(self, trace):
@@ -96,17 +227,29 @@ class Trace(object):
             if img not in self.images:
                 self.add_image(img)
             self.set_per_image[img].update(trace.set_per_image[img])
+            counts = self.counts_per_image[img]
+            for bbl, count in trace.counts_per_image[img].iteritems():
+                counts[bbl] = counts.get(bbl, 0) | count
             self.total += trace.total
+        self.edges.update(trace.edges)
 
 class Tracer(object):
     cache = None
+    blockmaps = None
+    idmps = None
     campaign = None
     analyzer = None
+    analyzers = None
     disassembler = None
     configuration = None
+    forkserver_inputs = None
+    parse_lock = None
+    virgin = None
 
     def __init__(self, configfile=None):
         self.cache = {}
+        self.blockmaps = {}
+        self.idmps = []
 
         print '[+] Loading configuration...'
         self.configuration = configuration.Configuration(configfile)
@@ -118,14 +261,155 @@ class Tracer(object):
                 )(self.configuration['DisassemblerPath'])
 
         print '[+] Loading Analyzer module...'
+        workers = 1
+        if 'Workers' in self.configuration:
+            workers = self.configuration['Workers']
+        self.analyzers = []
+        for worker in xrange(workers):
+            self.analyzers.append(self.create_analyzer(worker))
+        self.analyzer = self.analyzers[0]
+        if workers > 1:
+            # the BlockCache is not thread safe
+            self.parse_lock = threading.Lock()
+
+        self.initialize_campaign()
+
+        # the coverage of the campaign so far, to tell the novel traces
+        self.virgin = virgin.VirginMap(
+                os.path.join(self.campaign.campaign_dir, 'virgin.map'),
+                self.cache
+                )
+
+        if 'TraceCache' in self.configuration and \
+                self.configuration['TraceCache']:
+            # the pintool keeps how the blocks of the whitelisted images
+            # resolve across the runs of the campaign
+            for runner in self.analyzers:
+                runner.add_options(['-tcache',
+                        '"%s"' % self.campaign.campaign_dir])
+
+        if 'MapBlocksInPintool' in self.configuration and \
+                self.configuration['MapBlocksInPintool']:
+            # the pintool reports IDA basic blocks, so the BlockCache
+            # is queried with exact block starts only.
+            for dump in self.idmps:
+                for runner in self.analyzers:
+                    runner.add_options(['-idmp', '"%s"' % dump])
+
+        if isinstance(self.analyzer, analyzer.ForkServer):
+            # the command line of a server cannot change, so every seed
+            # is copied to the same file of its worker before it runs.
+            self.forkserver_inputs = []
+            for worker in xrange(workers):
+                self.forkserver_inputs.append(os.path.join(
+                        self.campaign.campaign_dir,
+                        'forksrv%d.input' % worker
+                        ))
+        print '[+] Tracer module is initialized.'
+
+    def create_analyzer(self, worker):
+        '''
+            Creates the analyzer of a worker, according to the
+            configuration.
+        '''
         if 'Timeout' not in self.configuration:
             timeout = 20
         else:
             timeout = self.configuration['Timeout']
-        self.analyzer = analyzer.Coverage(settings.pintool, timeout)
 
-        self.initialize_campaign()
-        print '[+] Tracer module is initialized.'
+        shared_memory = 0
+        if 'SharedMemory' in self.configuration:
+            shared_memory = self.configuration['SharedMemory']
+        if 'Persistent' in self.configuration and \
+                self.configuration['Persistent']:
+            iterations = 1000
+            if 'PersistentIterations' in self.configuration:
+                iterations = self.configuration['PersistentIterations']
+            runner = analyzer.PersistentServer(
+                    settings.pintool,
+                    timeout,
+                    self.get_pintool_options(),
+                    self.configuration['Persistent'],
+                    iterations,
+                    shared_memory
+                    )
+        elif 'ForkServer' in self.configuration and \
+                self.configuration['ForkServer']:
+            runner = analyzer.ForkServer(
+                    settings.pintool,
+                    timeout,
+                    self.get_pintool_options(),
+                    self.configuration['ForkServer'],
+                    shared_memory
+                    )
+        else:
+            runner = analyzer.Coverage(
+                    settings.pintool,
+                    timeout,
+                    self.get_pintool_options(),
+                    shared_memory
+                    )
+
+        if isinstance(runner, analyzer.ForkServer):
+            runner.control_name = 'forksrv%d' % worker
+        if 'CpuAffinity' in self.configuration and \
+                self.configuration['CpuAffinity']:
+            runner.set_affinity(worker % multiprocessing.cpu_count())
+        return runner
+
+    def get_pintool_options(self):
+        '''
+            Builds the list of extra pintool arguments from the
+            configuration.
+        '''
+        options = []
+        if 'Deduplicate' in self.configuration and \
+                self.configuration['Deduplicate']:
+            options.append('-dedup')
+        if 'FirstHitOnly' in self.configuration and \
+                self.configuration['FirstHitOnly']:
+            options.append('-firsthit')
+        if 'EdgeCoverage' in self.configuration and \
+                self.configuration['EdgeCoverage']:
+            options.append('-edges')
+        if 'HitCounts' in self.configuration and \
+                self.configuration['HitCounts']:
+            options.append('-hitcounts')
+        if 'StackHash' in self.configuration and \
+                self.configuration['StackHash']:
+            options.append('-stackhash')
+        if 'CmpLog' in self.configuration and \
+                self.configuration['CmpLog']:
+            options.append('-cmplog')
+        if 'TraceBatching' in self.configuration and \
+                self.configuration['TraceBatching']:
+            options.append('-tracebatch')
+        if 'AsyncBuffers' in self.configuration and \
+                self.configuration['AsyncBuffers']:
+            options.extend(['-async',
+                    '%d' % self.configuration['AsyncBuffers']])
+            if 'AsyncBufferSize' in self.configuration and \
+                    self.configuration['AsyncBufferSize']:
+                options.extend(['-bufsize',
+                        '%d' % self.configuration['AsyncBufferSize']])
+        if 'InstrumentRanges' in self.configuration:
+            for image, start, end in self.configuration['InstrumentRanges']:
+                options.extend(['-range', '%s:%x-%x' % (image, start, end)])
+        if 'InstrumentFunctions' in self.configuration:
+            for image, function in self.configuration['InstrumentFunctions']:
+                options.extend(['-fn', '%s:%s' % (image, function)])
+        if 'PintoolTimeout' in self.configuration and \
+                self.configuration['PintoolTimeout']:
+            options.extend(['-timeout',
+                    '%d' % self.configuration['PintoolTimeout']])
+            if 'PintoolCpuTime' in self.configuration and \
+                    self.configuration['PintoolCpuTime']:
+                options.append('-cputime')
+        if 'BasicBlockLimit' in self.configuration and \
+                self.configuration['BasicBlockLimit']:
+            options.extend(['-bblimit',
+                    '%d' % self.configuration['BasicBlockLimit']])
+        return options
 
     def initialize_campaign(self):
         '''
@@ -153,68 +437,366 @@ class Tracer(object):
                     output=self.campaign.campaign_dir
                 )
 
-        self.cache[os.path.basename(exe)] = bcache.BlockCache.parse_idmp(dmp)
+        cache = bcache.BlockCache.parse_idmp(dmp)
+        self.cache[os.path.basename(exe)] = cache
+        blockset.register(os.path.basename(exe), cache)
+        self.idmps.append(os.path.abspath(self.disassembler.get_dump_path(
+                exe, output=self.campaign.campaign_dir)))
+        if tracedecoder != None:
+            self.blockmaps[os.path.basename(exe)] = \
+                    tracedecoder.compile_blocks(cache.get_ranges())
 
     def parse_trace_file(self, trace_file):
         '''
-            Parses the format of the trace file (actually a named pipe).
-
-            The format of the trace file is the following:
-            [number of images, 1 byte ]
-            IMAGE SECTION
-            [
-               [image name length,  2 bytes]
-               [image name, variable length]
-               ...
-            ]
-            BASIC BLOCK SECTION
-            [
-               [image number,       8 bytes]
-               [basic block offset, 8 bytes]
-               ...
-            ]
-
-            Note that image section must be prior to basic block section.
-            If the image number attribute, in a chunk which is contained
-            in the basic block section, is 0xffffffffffffffff, then a
-            signal (in Linux) or an exception (in Windows) has been
-            raised in the monitored application.
+            Parses the trace file (actually a named pipe) and deletes it.
+            The format of the file is described in parse_trace_stream().
         '''
-        trace = Trace()
-        nimg = 0x0
-        with open(trace_file, 'rb') as fin:
-            nimg = ord(fin.read(1))
-            # read the image section
-            for _ in xrange(nimg):
-                imgname_sz, = struct.unpack('<H', fin.read(2))
-                image_name = fin.read(imgname_sz)
-                trace.add_image(os.path.basename(image_name))
-            # read the basic block section
-            buf = fin.read(16)
-            while buf:
-                ino, bbl = struct.unpack('<QQ', buf)
-                if ino == 0xffffffffffffffffL:
-                    if bbl != 0xC:
-                        trace.has_crashed = True
-                else:
-                    bbl = self.cache[trace.images[ino]].get_cached(bbl)
-                    if bbl != None:
-                        trace.add_bbl(trace.images[ino], bbl)
-                buf = fin.read(16)
+        # a buffered reader of the io module, so that read1() returns
+        # what the pintool has written so far
+        with io.open(trace_file, 'rb') as fin:
+            trace = self.parse_trace_stream(fin)
 
         self.campaign.delete_pipe(trace_file)
         return trace
 
-    def analyze(self, seedid):
+    def parse_trace_stream(self, fin):
+        '''
+            Parses a trace from a file-like object; either the named pipe
+            or the shared memory region of the analyzer. The format is
+            described in traceformat.
+
+            Every thread of the target writes its own SEC_RAW sections of
+            basic blocks, so sections of different threads may be
+            interleaved. A SEC_EVENT section, other than a timeout, means
+            that a signal (in Linux) or an exception (in Windows) has been
+            raised in the monitored application. It is followed by a
+            SEC_CRASH section with the faulting context, if the pintool
+            could capture it.
+
+            When the pintool runs with -dedup, the basic blocks come in
+            SEC_BLOCKS sections, where every basic block appears only once,
+            so the total count of the trace equals the number of unique
+            basic blocks.
+
+            When the pintool runs with -hitcounts, the basic blocks come in
+            SEC_COUNTS sections instead, along with the bucket of their hit
+            count, and the total count of the trace is the sum of the
+            buckets.
+
+            When the pintool runs with -edges, a SEC_EDGES section holds the
+            index of every edge that was hit in the edge map, along with its
+            hit count bucket.
+
+            When the pintool runs with -cmplog, SEC_CMPS sections hold the
+            operands of the comparisons of the whitelisted images.
+
+            The trace ends with a SEC_STATS section, with the counters of
+            the pintool for the run.
+
+            When the pintool runs with -tracebatch, SEC_TRACES sections hold
+            the executed Pin traces instead of basic blocks, as the id of the
+            trace and the number of its basic blocks that ran. The blocks of
+            the traces are read from the SEC_TRACE_TABLE sections.
+
+            When the pintool runs with -idmp, the header has the
+            TRACE_FLAG_IDA flag and the offsets are the starts of the
+            IDA basic blocks, so get_cached() finds them without any
+            bisection nor new entries in the BlockCache.
+
+            The native decoder is used instead, if it has been built. It
+            decodes the trace while it is read, so that the decoding of a
+            run overlaps with its execution and the trace is complete as
+            soon as the pintool closes the channel.
+        '''
+        if tracedecoder != None:
+            return self.parse_trace_native(fin)
+        if self.parse_lock != None:
+            # the pintool must not wait for the other workers
+            data = io.BytesIO(fin.read())
+            with self.parse_lock:
+                return self.parse_trace_python(data)
+        return self.parse_trace_python(fin)
+
+    def parse_trace_python(self, fin):
+        '''
+            The pure Python decoder of parse_trace_stream().
+        '''
+        trace = Trace()
+        _, images = traceformat.read_header(fin)
+        for image_name in images:
+            trace.add_image(os.path.basename(image_name))
+
+        traces = []
+        table = {}
+        for stype, payload in traceformat.read_sections(fin):
+            if stype == traceformat.SEC_BLOCKS:
+                values = traceformat.varints(payload)
+                image = trace.images[next(values)]
+                offset = 0
+                for delta in values:
+                    offset += delta
+                    self.add_offset(trace, image, offset)
+            elif stype == traceformat.SEC_COUNTS:
+                values = traceformat.varints(payload)
+                image = trace.images[next(values)]
+                offset = 0
+                for delta in values:
+                    offset += delta
+                    self.add_offset(trace, image, offset, next(values))
+            elif stype == traceformat.SEC_RAW:
+                values = traceformat.varints(payload, 4)
+                offset = 0
+                for ino in values:
+                    offset += traceformat.unzigzag(next(values))
+                    self.add_offset(trace, trace.images[ino], offset)
+            elif stype == traceformat.SEC_EDGES:
+                values = traceformat.varints(payload)
+                edge = 0
+                for delta in values:
+                    edge += delta
+                    trace.add_edge(edge, next(values))
+            elif stype == traceformat.SEC_EVENT:
+                info, = traceformat.varints(payload, 4)
+                if info != 0xC:
+                    trace.has_crashed = True
+            elif stype == traceformat.SEC_CRASH:
+                self.parse_crash(payload, trace)
+            elif stype == traceformat.SEC_CMPS:
+                self.parse_cmps(payload, trace)
+            elif stype == traceformat.SEC_STATS:
+                self.parse_stats(payload, trace)
+            elif stype == traceformat.SEC_TRACES:
+                # resolved once the trace table has been read
+                traces.extend(traceformat.varints(payload, 4))
+            elif stype == traceformat.SEC_TRACE_TABLE:
+                self.parse_trace_table(payload, table, trace)
+
+        for record in traces:
+            image, offsets = table[record >> 16]
+            for offset in offsets[:record & 0xffff]:
+                if offset != traceformat.TRACE_SKIP:
+                    self.add_offset(trace, image, offset)
+
+        return trace
+
+    def parse_trace_native(self, fin):
+        '''
+            Same as parse_trace_stream(), but the sections are decoded
+            by the native decoder of analyzer/decoder, in chunks of what
+            has been read so far.
+        '''
+        trace = Trace()
+        _, images = traceformat.read_header(fin)
+        blockmaps = []
+        for image_name in images:
+            image = os.path.basename(image_name)
+            trace.add_image(image)
+            blockmaps.append(self.blockmaps.get(image))
+
+        decoder = tracedecoder.Decoder(blockmaps)
+        read = getattr(fin, 'read1', fin.read)
+        while True:
+            data = read(READ_SIZE)
+            if not data:
+                break
+            decoder.feed(data)
+
+        blocks, totals, counts, edges, crashed, rest = decoder.result()
+        for image, bbls, total, buckets in zip(trace.images, blocks,
+                totals, counts):
+            trace.set_per_image[image].update(bbls)
+            if buckets != None:
+                trace.counts_per_image[image].update(
+                        (bbl, count) for bbl, count in zip(bbls, buckets)
+                        if count)
+            trace.total += total
+        trace.edges.update(edges)
+        trace.has_crashed = crashed
+        for stype, payload in rest:
+            if stype == traceformat.SEC_CRASH:
+                self.parse_crash(payload, trace)
+            elif stype == traceformat.SEC_CMPS:
+                self.parse_cmps(payload, trace)
+            elif stype == traceformat.SEC_STATS:
+                self.parse_stats(payload, trace)
+        return trace
+
+    def parse_crash(self, payload, trace):
+        '''
+            Reads a SEC_CRASH section into the trace.
+        '''
+        values = traceformat.varints(payload, 4)
+        signal, image, offset, fault, stack, depth, length = \
+                [next(values) for _ in xrange(7)]
+        if image == 0:
+            name = payload[len(payload) - length:] or 'unknown'
+        else:
+            name = trace.images[image - 1]
+        trace.set_crash(signal, name, offset, fault, stack, depth)
+
+    def parse_cmps(self, payload, trace):
+        '''
+            Reads a SEC_CMPS section into the trace. The sites are of no
+            interest to the mutators, only the operands are kept.
+        '''
+        pos = 0
+        while pos < len(payload):
+            _, pos = traceformat.read_varint(payload, pos)
+            kind, pos = traceformat.read_varint(payload, pos)
+            pairs, pos = traceformat.read_varint(payload, pos)
+            for _ in xrange(pairs):
+                length, pos = traceformat.read_varint(payload, pos)
+                a = payload[pos:pos + length]
+                b = payload[pos + length:pos + 2 * length]
+                pos += 2 * length
+                trace.add_cmp(kind, a, b)
+
+    def parse_stats(self, payload, trace):
+        '''
+            Reads the SEC_STATS trailer into the stats of the trace.
+        '''
+        trace.stats.update(zip(traceformat.STATS,
+                traceformat.varints(payload)))
+
+    def add_offset(self, trace, image, offset, count=None):
+        '''
+            Maps the offset of a Pin basic block to the IDA basic block
+            that contains it and adds it to the trace.
+        '''
+        bbl = self.cache[image].get_cached(offset)
+        if bbl != None:
+            trace.add_bbl(image, bbl, count)
+
+    def parse_trace_table(self, payload, table, trace):
+        '''
+            Reads a section of the trace table into table, which maps the
+            id of a trace to its image and the offsets of its basic blocks.
+        '''
+        values = traceformat.varints(payload)
+        tid = next(values)
+        for ino in values:
+            offsets = []
+            offset = 0
+            for _ in xrange(next(values)):
+                offset += traceformat.unzigzag(next(values))
+                offsets.append(offset)
+            table[tid] = (trace.images[ino], offsets)
+            tid += 1
+
+    def analyze(self, seedid, worker=0):
         '''
             Grabs a seed from the corpus, executes the application using
-            the analyzer module and returns the trace.
+            the analyzer of the worker and returns the trace. The trace is
+            flagged as novel if it hit anything that no trace of the
+            campaign has hit before. An incomplete trace is never novel,
+            its coverage does not reach the virgin map.
+        '''
+        trace = self.run(seedid, worker)
+        trace.is_novel = trace.is_complete and self.virgin.update(trace)
+        return trace
+
+    def run(self, seedid, worker=0):
         '''
+            Executes the application with the seed and parses its trace,
+            the coverage of the campaign is left untouched.
+        '''
+        start = time.time()
+        runner = self.analyzers[worker]
         path = self.campaign.get(seedid)
+        if self.forkserver_inputs != None:
+            shutil.copyfile(path, self.forkserver_inputs[worker])
+            path = self.forkserver_inputs[worker]
         output = self.campaign.create_pipe('%s.dmp' % seedid)
         cmd = self.configuration['Command'] % path
         os.chdir(self.campaign.campaign_dir)
-        dmp = self.analyzer.run(execmd=cmd, output=output,
+        dmp = runner.run(execmd=cmd, output=output,
                                 whitelist=self.configuration['Whitelist'])
-        return self.parse_trace_file(dmp)
+        if runner.shared != None:
+            # there is no EOF on shared memory, the run must finish first
+            runner.wait()
+            trace = self.parse_trace_stream(runner.shared.open())
+            if runner.shared.overflowed():
+                print '[!] WARNING: the shared memory region overflowed, ' \
+                        'the trace of %s is incomplete.' % seedid
+                trace.is_complete = False
+        else:
+            trace = self.parse_trace_file(dmp)
+        trace.stats['wall_us'] = int((time.time() - start) * 1000000)
+        return trace
+
+    def analyze_all(self, seedids, novelty=True):
+        '''
+            Analyzes the seeds with all the workers concurrently, every
+            worker has its own analyzer. Returns the traces in the order
+            of the seeds. Without novelty the seeds are only run, so
+            their coverage does not reach the virgin map.
+        '''
+        execute = self.analyze if novelty else self.run
+        if len(self.analyzers) == 1:
+            traces = [execute(seedid) for seedid in seedids]
+            self.log_stats(traces)
+            return traces
+
+        jobs = Queue.Queue()
+        for index, seedid in enumerate(seedids):
+            jobs.put((index, seedid))
+        traces = [None] * len(seedids)
+        errors = []
+
+        def work(worker):
+            while not errors:
+                try:
+                    index, seedid = jobs.get_nowait()
+                except Queue.Empty:
+                    return
+                try:
+                    traces[index] = execute(seedid, worker)
+                except Exception, ex:
+                    errors.append(ex)
+
+        threads = []
+        for worker in xrange(len(self.analyzers)):
+            thread = threading.Thread(target=work, args=(worker,))
+            thread.start()
+            threads.append(thread)
+        for thread in threads:
+            thread.join()
+
+        if errors:
+            raise errors[0]
+        self.log_stats(traces)
+        return traces
+
+    def log_stats(self, traces):
+        '''
+            Adds up the statistics of the traces and writes them to the
+            campaign log, along with the share of the wall clock time of
+            the runs that went to the instrumentation and to waiting for
+            the driver to read the traces. The rest is the target and Pin
+            itself.
+        '''
+        if not traces:
+            return
+        totals = dict((name, 0) for name in traceformat.STATS)
+        totals['wall_us'] = 0
+        for trace in traces:
+            for name, value in trace.stats.iteritems():
+                totals[name] = totals.get(name, 0) + value
+
+        wall = max(totals['wall_us'], 1)
+        self.campaign.log(
+                'Stats of %d executions: %.2fs in total, %.1f%% '
+                'instrumenting, %.1f%% blocked on the driver; %d traces '
+                'compiled, %d instrumented; %d writes, %d bytes; '
+                '%d threads' % (
+                    len(traces),
+                    totals['wall_us'] / 1000000.0,
+                    100.0 * totals['jit_us'] / wall,
+                    100.0 * totals['blocked_us'] / wall,
+                    totals['traces'],
+                    totals['instrumented'],
+                    totals['writes'],
+                    totals['bytes'],
+                    totals['threads'],
+                    ))
 
@@ -0,0 +1,308 @@
+'''
+    virgin.py keeps the coverage of the whole campaign, like the virgin
+    bits of AFL. The map is a file inside the campaign directory that is
+    memory mapped, so it survives restarts of the campaign and it is
+    shared between the workers of the tracer and every Choronzon instance
+    that uses the same campaign directory. The merges are serialized by a
+    lock on virgin.map.lock, a file next to the map, which the threads of
+    an instance take in turn as well.
+
+    A trace is novel if it hits a basic block, a hit count bucket of a
+    basic block or a bucket of an edge that no other trace has hit.
+
+    The map starts with the following header:
+    [magic,             4 bytes]
+    [version,           4 bytes]
+    [size of the map,   4 bytes]
+    [layout,            4 bytes]
+
+    and continues with the regions of every image, sorted by name:
+    [bitset of the basic blocks, by BlockCache id, rounded to 8 bytes]
+    [the hit count buckets seen per basic block, 1 byte each]
+
+    followed by the buckets seen per edge of the edge map, 1 byte each.
+    Hit count buckets are powers of two, so a byte holds all of them.
+    The layout is a crc32 of the names and block counts of the images,
+    a map of another layout is replaced by an empty one. An instance of
+    another layout that still has the old map open keeps its own copy.
+
+    The coverage of a single trace is exchanged between the instances of
+    a distributed campaign in the same layout, as the chunks of the map
+    it would set (see pack()). It is a few KB at most, so a node checks
+    it against its own map before it fetches and runs the input. It
+    starts with the header of the map that packed it, and a node of
+    another layout imports the input as if it came without coverage. The
+    instances that share the map itself already know the coverage of
+    each other, their chromosomes are always exchanged.
+'''
+
+import os
+import mmap
+import zlib
+import struct
+import binascii
+import platform
+import tempfile
+import threading
+
+if platform.system() == 'Windows':
+    import msvcrt
+else:
+    import fcntl
+
+import blockset
+
+VIRGIN_MAGIC = 'CHVM'
+VIRGIN_VERSION = 2
+EDGE_MAP_SIZE = 1 << 16
+
+HEADER = struct.Struct('<4sIII')
+CHUNK = struct.Struct('<II') # offset and size of a chunk of pack()
+NODE = struct.Struct('<I') # the map that packed the coverage
+
+def _toint(data):
+    return int(binascii.hexlify(data[::-1]), 16) if data else 0
+
+def _tobytes(value, size):
+    data = ('%x' % value).rjust(size * 2, '0')
+    return binascii.unhexlify(data)[::-1]
+
+class FileLock(object):
+    '''
+        An exclusive lock on a file, between the processes and the
+        threads of a process alike.
+    '''
+    fd = None
+    lock = None
+
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR | os.O_CREAT |
+                getattr(os, 'O_BINARY', 0), 0600)
+        self.lock = threading.Lock()
+
+    def __enter__(self):
+        self.lock.acquire()
+        try:
+            if platform.system() == 'Windows':
+                os.lseek(self.fd, 0, os.SEEK_SET)
+                while True:
+                    try:
+                        msvcrt.locking(self.fd, msvcrt.LK_LOCK, 1)
+                        break
+                    except IOError:
+                        # LK_LOCK gives up after 10 seconds
+                        continue
+            else:
+                fcntl.flock(self.fd, fcntl.LOCK_EX)
+        except:
+            self.lock.release()
+            raise
+        return self
+
+    def __exit__(self, *args):
+        try:
+            if platform.system() == 'Windows':
+                os.lseek(self.fd, 0, os.SEEK_SET)
+                msvcrt.locking(self.fd, msvcrt.LK_UNLCK, 1)
+            else:
+                fcntl.flock(self.fd, fcntl.LOCK_UN)
+        finally:
+            self.lock.release()
+
+    def close(self):
+        os.close(self.fd)
+
+class VirginMap(object):
+    '''
+        The campaign wide coverage map. The layout depends on the basic
+        blocks of the images, a map of another layout is replaced.
+    '''
+    path = None
+    mmap = None
+    regions = None
+    edges = None
+    lock = None
+    node = None
+
+    def __init__(self, path, caches):
+        self.path = path
+        self.lock = FileLock(path + '.lock')
+        self.node = binascii.crc32('%s:%s' % (platform.node(),
+                os.path.abspath(path))) & 0xffffffff
+
+        # image -> (offset of the bitset, its size, offset of the buckets)
+        self.regions = {}
+        offset = HEADER.size
+        layout = 0
+        for image in sorted(caches):
+            nblocks = caches[image].get_block_count()
+            nbytes = (nblocks + 63) // 64 * 8
+            self.regions[image] = (offset, nbytes, offset + nbytes)
+            offset += nbytes + nblocks
+            layout = binascii.crc32('%s:%d\n' % (image, nblocks), layout)
+        self.edges = offset
+        size = offset + EDGE_MAP_SIZE
+
+        header = HEADER.pack(VIRGIN_MAGIC, VIRGIN_VERSION, size,
+                layout & 0xffffffff)
+        with self.lock:
+            if self.read_header() != header:
+                self.reset(header, size)
+            fd = os.open(path, os.O_RDWR | getattr(os, 'O_BINARY', 0))
+            try:
+                self.mmap = mmap.mmap(fd, size)
+            finally:
+                os.close(fd)
+
+    def read_header(self):
+        '''
+            Returns the header of the map on disk, None if there is none.
+        '''
+        try:
+            with open(self.path, 'rb') as fin:
+                return fin.read(HEADER.size)
+        except IOError:
+            return None
+
+    def reset(self, header, size):
+        '''
+            Replaces the map on disk by an empty one of the given header.
+            The new map is renamed over the old one, so the instances that
+            have the old one mapped do not see it change under them.
+        '''
+        fd, temp = tempfile.mkstemp(dir=os.path.dirname(self.path) or '.')
+        try:
+            with os.fdopen(fd, 'wb') as fout:
+                fout.write(header)
+                fout.truncate(size)
+            if platform.system() == 'Windows' and os.path.exists(self.path):
+                # fails while another instance has the map open
+                os.remove(self.path)
+            os.rename(temp, self.path)
+        except:
+            if os.path.exists(temp):
+                os.remove(temp)
+            raise
+
+    def has_new_bits(self, offset, data):
+        '''
+            Merges the bytes into the map at offset and returns True if
+            any bit of them was not set.
+        '''
+        size = len(data)
+        value = _toint(data)
+        old = _toint(self.mmap[offset:offset + size])
+        if not value & ~old:
+            return False
+        self.mmap[offset:offset + size] = _tobytes(value | old, size)
+        return True
+
+    def has_new_bucket(self, offset, bucket):
+        '''
+            Same as has_new_bits(), for a single byte of buckets.
+        '''
+        old = ord(self.mmap[offset])
+        if not bucket & ~old:
+            return False
+        self.mmap[offset] = chr((old | bucket) & 0xff)
+        return True
+
+    def chunks(self, trace):
+        '''
+            Yields the (offset, bytes) chunks of the map that the coverage
+            of the trace sets.
+        '''
+        for img in trace.images:
+            if img not in self.regions:
+                continue
+            blocks, nbytes, counts = self.regions[img]
+
+            bbls = trace.set_per_image[img]
+            if isinstance(bbls, blockset.BlockSet):
+                data = bbls.bits.tobytes()[:nbytes]
+                # the bitsets of a trace are mostly zeros at both ends
+                start = len(data) - len(data.lstrip('\x00'))
+                data = data.rstrip('\x00')
+                if len(data) > start:
+                    yield blocks + start, data[start:]
+
+            cache = blockset.caches[img]
+            for bbl, mask in trace.counts_per_image[img].iteritems():
+                bid = cache.find_id(bbl)
+                if bid != None:
+                    yield counts + bid, chr(mask & 0xff)
+
+        for edge, bucket in trace.edges:
+            if edge < EDGE_MAP_SIZE:
+                yield self.edges + edge, chr(bucket & 0xff)
+
+    def merge(self, chunks):
+        '''
+            Merges the chunks into the map and returns True if any of them
+            sets a bit that was not set.
+        '''
+        novel = False
+        with self.lock:
+            for offset, data in chunks:
+                if len(data) == 1:
+                    novel |= self.has_new_bucket(offset, ord(data))
+                else:
+                    novel |= self.has_new_bits(offset, data)
+        return novel
+
+    def update(self, trace):
+        '''
+            Merges the coverage of the trace into the map and returns True
+            if the trace hit anything new.
+        '''
+        return self.merge(self.chunks(trace))
+
+    def pack(self, trace):
+        '''
+            Returns the coverage of the trace as a compressed bytestring,
+            which only a map of the same layout accepts.
+        '''
+        body = ''.join(CHUNK.pack(offset, len(data)) + data
+                for offset, data in self.chunks(trace))
+        return self.mmap[:HEADER.size] + NODE.pack(self.node) + \
+                zlib.compress(body)
+
+    def unpack(self, packed):
+        '''
+            Returns the chunks of a bytestring of pack(), or None if it
+            was packed by this map, by a map of another layout or it is
+            corrupted. The chunks of another layout would set unrelated
+            bits; the input is then fetched and run like any other.
+        '''
+        start = HEADER.size + NODE.size
+        if len(packed) < start:
+            return None
+        magic, version, size, layout = HEADER.unpack_from(packed)
+        _, _, own_size, own_layout = HEADER.unpack_from(self.mmap)
+        if magic != VIRGIN_MAGIC or version != VIRGIN_VERSION or \
+                size != own_size or layout != own_layout or \
+                NODE.unpack_from(packed, HEADER.size)[0] == self.node:
+            return None
+        try:
+            body = zlib.decompress(packed[start:])
+        except zlib.error:
+            return None
+
+        chunks = []
+        size = len(self.mmap)
+        pos = 0
+        while pos + CHUNK.size <= len(body):
+            offset, length = CHUNK.unpack_from(body, pos)
+            pos += CHUNK.size
+            data = body[pos:pos + length]
+            pos += length
+            if len(data) != length or not length or offset < HEADER.size \
+                    or offset + length > size:
+                return None
+            chunks.append((offset, data))
+        return chunks if pos == len(body) else None
+
+    def close(self):
+        self.mmap.flush()
+        self.mmap.close()
+        self.lock.close()
@@ -4,6 +4,7 @@
 '''
 import random
 import tracer
+import blockset
 
 import campaign
 import chromosome
@@ -56,6 +57,74 @@ class NaiveSelector(object):
         return objkey
 
 
+class BlockRefs(object):
+    '''
+        Counts the chromosomes of a generation that hit every basic block.
+        The blocks that are hit by more than one chromosome are also kept
+        in a set per image, so the blocks that only one chromosome hits
+        are the blocks of its trace that are not in that set.
+    '''
+    counts = None
+    shared = None
+
+    def __init__(self):
+        self.counts = {}
+        self.shared = tracer.Trace()
+
+    def add(self, trace):
+        '''
+            Adds a reference to every basic block of the trace.
+        '''
+        for img in trace.images:
+            if img not in self.counts:
+                self.counts[img] = {}
+                self.shared.add_image(img)
+            counts = self.counts[img]
+            shared = self.shared.set_per_image[img]
+            for bbl in trace.set_per_image[img]:
+                count = counts.get(bbl, 0) + 1
+                counts[bbl] = count
+                if count == 2:
+                    shared.add(bbl)
+
+    def remove(self, trace):
+        '''
+            Drops a reference from every basic block of the trace, which
+            must have been added before.
+        '''
+        for img in trace.images:
+            counts = self.counts[img]
+            shared = self.shared.set_per_image[img]
+            for bbl in trace.set_per_image[img]:
+                count = counts[bbl] - 1
+                if count == 0:
+                    del counts[bbl]
+                    continue
+                counts[bbl] = count
+                if count == 1:
+                    shared.discard(bbl)
+
+    def get_shared(self, img):
+        '''
+            Returns the set of the basic blocks of the image that are hit by
+            more than one chromosome.
+        '''
+        return self.shared.set_per_image[img]
+
+    def get_unique_total(self, bbls_per_image):
+        '''
+            Returns the number of the given basic blocks, per image, that
+            are hit by at most one chromosome. For the blocks of an added
+            trace, those are the blocks that no other chromosome hits.
+        '''
+        count = 0x0
+        for img, bbls in bbls_per_image:
+            if img not in self.counts:
+                count += len(bbls)
+                continue
+            count += blockset.difference_count(bbls, self.get_shared(img))
+        return count
+
 class Generation(object):
     '''
         A Generation object holds the chromosomes along with the metrics
@@ -63,6 +132,8 @@ class Generation(object):
     '''
     epoch = None
     trace = None
+    refs = None
+    covered = None
     max_metrics = None
     min_metrics = None
     chromosomes = None
@@ -77,6 +148,9 @@ class Generation(object):
         self.chromosomes = dict()
         self.selector = None
         self.trace = tracer.Trace()
+        # the uids of the chromosomes whose trace is counted in refs
+        self.refs = BlockRefs()
+        self.covered = set()
         self.max_metrics = dict()
         self.min_metrics = dict()
 
@@ -130,6 +204,9 @@ class Generation(object):
             any list or dictionary as well as the file from the disk.
         '''
         chromo = self.get_chromosome(uid)
+        if uid in self.covered:
+            self.refs.remove(chromo.trace)
+            self.covered.discard(uid)
         self.campaign.delete_chromosome(uid)
         del self.chromosomes[uid]
         return chromo
@@ -200,6 +277,18 @@ class Generation(object):
                     or metrics[name] < self.min_metrics[name]:
                 self.min_metrics[name] = metrics[name]
 
+    def add_coverage(self, uid, old, trace):
+        '''
+            Adds the trace of the chromosome with the given uid to the
+            generation trace and the block references. old is the trace
+            that the chromosome had before, which is replaced.
+        '''
+        if uid in self.covered:
+            self.refs.remove(old)
+        self.refs.add(trace)
+        self.covered.add(uid)
+        self.trace.update(trace)
+
     def extend(self, dct):
         '''
             Extends the chromosomes in the current generation.
@@ -373,9 +462,10 @@ class Population(object):
             Adds a trace to the target chromosome.
         '''
         chromo = self.current[uid]
+        old = chromo.trace
         chromo.trace = trace
         self.current[uid] = chromo
-        self.current.trace.update(trace)
+        self.current.add_coverage(uid, old, trace)
 
     def elitism(self):
         '''
@@ -441,5 +531,5 @@ class Population(object):
 
         # set up the generation metrics/stats
         for chromo in new.get_all():
-            new.trace.update(chromo.trace)
+            new.add_coverage(chromo.uid, None, chromo.trace)
             new.set_metrics(chromo.uid, chromo.metrics)